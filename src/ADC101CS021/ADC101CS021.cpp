@@ -6,9 +6,10 @@
 
 #include "ADC101CS021.h"
 
-adc101::adc101(int i2cFile, uint8_t addrIn) {
+template <typename mapT>
+adcC02x<mapT>::adcC02x(int i2cFile, uint8_t addrIn) {
   //I2C file
-  i2cFile = i2cFile;
+  this->i2cFile = i2cFile;
   addr = addrIn;
   //Status
   conversion = 0x301A;
@@ -26,22 +27,31 @@ adc101::adc101(int i2cFile, uint8_t addrIn) {
   hysteresis    = 0x0005;
   lowestConv    = 0x0FFF;
   highestConv   = 0x0000;
+  configured = false;
+  //Device state unknown until written or read back
+  for (unsigned ii = 0; ii < 8; ii++) {
+    devReg[ii] = 0;
+    devRegValid[ii] = false;
+  }
 }
 
-adc101::~adc101() {
+template <typename mapT>
+adcC02x<mapT>::~adcC02x() {
   i2cFile = 0;
   conversion = 0xB01A;
   alertFlag = false;
 }
 
 
-void adc101::updateConv(uint16_t &value, bool &alert) {
+template <typename mapT>
+void adcC02x<mapT>::updateConv(uint16_t &value, bool &alert) {
   value = conversion;
   alert = alertFlag;
 }
 
 
-bool adc101::getConv(uint16_t &value, bool &alert) {
+template <typename mapT>
+bool adcC02x<mapT>::getConv(uint16_t &value, bool &alert) {
   bool bSuccess = false;
   bSuccess = singleNormalConversion();
   updateConv(value, alert);
@@ -49,56 +59,67 @@ bool adc101::getConv(uint16_t &value, bool &alert) {
 }
 
 
-void adc101::startAutoConv(adc101::cycleTimeT timer) {
+template <typename mapT>
+bool adcC02x<mapT>::startAutoConv(cycleTimeT timer) {
   cycleTime = timer;
-  configure();
+  return configure();
 }
 
 
-void adc101::stopAutoConv() {
+template <typename mapT>
+bool adcC02x<mapT>::stopAutoConv() {
   cycleTime = cycleTimeT::off;
-  configure();
+  return configure();
 }
 
 
-bool adc101::readByte(uint8_t* value){
-  bool bSuccess = false;
-  // read back value
-  if (read(i2cFile, value, 1) == 1){
-    bSuccess = true;
+template <typename mapT>
+bool adcC02x<mapT>::atPowerOnDefaults() {
+  return devRegValid[regListT::cfgReg] && devReg[regListT::cfgReg] == 0x00;
+}
+
+
+template <typename mapT>
+typename adcC02x<mapT>::cycleTimeT adcC02x<mapT>::getCycleTime() {
+  if (!devRegValid[regListT::cfgReg]) {
+    return cycleTimeT::off;
   }
-  return bSuccess;
+  return static_cast<cycleTimeT>(mapT::cycleTime::decode(devReg[regListT::cfgReg]));
+}
+
+
+template <typename mapT>
+bool adcC02x<mapT>::readByte(uint8_t* value){
+  // read back value
+  return transfer(value, 1, I2C_M_RD);
 }
 
 
-bool adc101::readWord(uint16_t &value){
+template <typename mapT>
+bool adcC02x<mapT>::readWord(uint16_t &value){
   bool bSuccess = false;
-  uint8_t fromI2c[2];
+  uint8_t fromI2c[mapT::wordReg::size];
   // read back value
-  if (read(i2cFile, &fromI2c, sizeof(fromI2c)) == sizeof(fromI2c)){
-    value = ((fromI2c[0]<<8)&0xFF00) | (fromI2c[1]&0x00FF);
+  if (transfer(fromI2c, sizeof(fromI2c), I2C_M_RD)){
+    value = mapT::wordReg::read(fromI2c);
     bSuccess = true;
   }
   return bSuccess;
 }
 
 
-bool adc101::setPointer(uint8_t address) {
-  bool bSuccess = false;
-  if (write(i2cFile, &address, sizeof(address)) == sizeof(address)) {
-      bSuccess = true;
-  }
-  return bSuccess;
+template <typename mapT>
+bool adcC02x<mapT>::setPointer(uint8_t address) {
+  return transfer(&address, sizeof(address), 0);
 }
 
-bool adc101::writeByte(uint8_t address, uint8_t value) {
+template <typename mapT>
+bool adcC02x<mapT>::writeByte(uint8_t address, uint8_t value) {
   bool bSuccess = false;
-  uint8_t buffer[2];
-  
-  buffer[0] = address;              // Address
-  buffer[1] = value & 0xFF;         // Value
+  // Address, value
+  typename mapT::byteReg::frameT buffer = mapT::byteReg::write(address, value);
   
-  if (write(i2cFile, buffer, sizeof(buffer)) == sizeof(buffer)) {
+  if (transfer(buffer.data, sizeof(buffer.data), 0)) {
       //perror("Failed to write register %d with value %02x to ADC", address, value);
       //exit(1);
       bSuccess = true;
@@ -107,15 +128,13 @@ bool adc101::writeByte(uint8_t address, uint8_t value) {
 }
 
 
-bool adc101::writeWord(uint8_t address, uint16_t value) {
+template <typename mapT>
+bool adcC02x<mapT>::writeWord(uint8_t address, uint16_t value) {
   bool bSuccess = false;
-  uint8_t buffer[3];
-  
-  buffer[0] = address;              // Address
-  buffer[1] = value & 0xFF;         // Value LSB
-  buffer[2] = (value >> 8) & 0xFF;  // Value MSB
+  // Address, value MSB, value LSB
+  typename mapT::wordReg::frameT buffer = mapT::wordReg::write(address, value);
   
-  if (write(i2cFile, buffer, sizeof(buffer)) == sizeof(buffer)) {
+  if (transfer(buffer.data, sizeof(buffer.data), 0)) {
       //perror("Failed to write register %d with value %04x to ADC", address, value);
       //exit(1);
       bSuccess = true;
@@ -124,7 +143,122 @@ bool adc101::writeWord(uint8_t address, uint16_t value) {
 }
 
 
-bool adc101::readConversion() {
+template <typename mapT>
+bool adcC02x<mapT>::transfer(uint8_t* buf, uint16_t len, uint16_t flags) {
+  struct i2c_msg msg;
+  struct i2c_rdwr_ioctl_data xfer;
+
+  msg.addr  = addr;
+  msg.flags = flags;
+  msg.len   = len;
+  msg.buf   = buf;
+  xfer.msgs  = &msg;
+  xfer.nmsgs = 1;
+
+  return ioctl(i2cFile, I2C_RDWR, &xfer) == 1;
+}
+
+
+template <typename mapT>
+bool adcC02x<mapT>::readRegister(uint8_t address, uint16_t &value, uint16_t len) {
+  struct i2c_msg msgs[2];
+  struct i2c_rdwr_ioctl_data xfer;
+  uint8_t fromI2c[2] = {0, 0};
+
+  msgs[0].addr  = addr;
+  msgs[0].flags = 0;
+  msgs[0].len   = sizeof(address);
+  msgs[0].buf   = &address;
+  msgs[1].addr  = addr;
+  msgs[1].flags = I2C_M_RD;
+  msgs[1].len   = (len < sizeof(fromI2c)) ? len : sizeof(fromI2c);
+  msgs[1].buf   = fromI2c;
+  xfer.msgs  = msgs;
+  xfer.nmsgs = 2;
+
+  if (ioctl(i2cFile, I2C_RDWR, &xfer) != 2) {
+    return false;
+  }
+  if (msgs[1].len == mapT::wordReg::size) {
+    value = mapT::wordReg::read(fromI2c);
+  } else {
+    value = mapT::byteReg::read(fromI2c);
+  }
+  return true;
+}
+
+
+template <typename mapT>
+bool adcC02x<mapT>::updateByte(uint8_t address, uint8_t value) {
+  if (devRegValid[address] && devReg[address] == value) {
+    return true;
+  }
+  devRegValid[address] = writeByte(address, value);
+  devReg[address] = value;
+  return devRegValid[address];
+}
+
+
+template <typename mapT>
+bool adcC02x<mapT>::updateWord(uint8_t address, uint16_t value) {
+  if (devRegValid[address] && devReg[address] == value) {
+    return true;
+  }
+  devRegValid[address] = writeWord(address, value);
+  devReg[address] = value;
+  return devRegValid[address];
+}
+
+
+template <typename mapT>
+bool adcC02x<mapT>::adoptState() {
+  uint16_t cfg;
+  uint16_t words[5];
+
+  if (!readRegister(regListT::cfgReg, cfg, 1)) {
+    return false;
+  }
+  for (uint8_t ii = 0; ii < 5; ii++) {
+    if (!readRegister(regListT::lowLimReg + ii, words[ii], 2)) {
+      return false;
+    }
+  }
+
+  cycleTime     = static_cast<cycleTimeT>(mapT::cycleTime::decode(cfg));
+  alertHold     = mapT::alertHold::decode(cfg);
+  alertFlagEn   = mapT::alertFlagEn::decode(cfg);
+  alertPinEn    = mapT::alertPinEn::decode(cfg);
+  alertPolarity = mapT::alertPolarity::decode(cfg);
+  lowerLimit    = mapT::dataField::decode(words[0]);
+  higherLimit   = mapT::dataField::decode(words[1]);
+  hysteresis    = mapT::dataField::decode(words[2]);
+  lowestConv    = mapT::dataField::decode(words[3]);
+  highestConv   = mapT::dataField::decode(words[4]);
+
+  devReg[regListT::cfgReg] = cfg;
+  devRegValid[regListT::cfgReg] = true;
+  for (uint8_t ii = 0; ii < 5; ii++) {
+    devReg[regListT::lowLimReg + ii] = words[ii];
+    devRegValid[regListT::lowLimReg + ii] = true;
+  }
+  return true;
+}
+
+
+template <typename mapT>
+bool adcC02x<mapT>::reapplyState() {
+  for (unsigned ii = 0; ii < 8; ii++) {
+    devRegValid[ii] = false;
+  }
+  if (!configured) {
+    return true;
+  }
+  return configure();
+}
+
+
+template <typename mapT>
+bool adcC02x<mapT>::readConversion() {
   uint16_t tempVal;
   if (!readWord(tempVal)){
     //perror("Failed to read conversion from ADC");
@@ -132,68 +266,177 @@ bool adc101::readConversion() {
     return false;
   }
   
-  alertFlag = tempVal>>15;
-  conversion = (tempVal & 0x0FFC)>>2;
+  decodeConversion(tempVal, conversion, alertFlag);
   return true;
 }
 
 
-void adc101::configure() {
-  uint8_t tempByte = 0x0;
+template <typename mapT>
+void adcC02x<mapT>::decodeConversion(uint16_t word, uint16_t &value, bool &alert) {
+  alert = mapT::alertFlag::decode(word);
+  value = mapT::dataField::decode(word);
+}
+
+
+template <typename mapT>
+unsigned adcC02x<mapT>::batchConversion(int i2cFile, const uint8_t* addrs,
+                                 uint16_t* conv, bool* alert, bool* ok,
+                                 unsigned n) {
+  struct i2c_msg msgs[3*batchMax];
+  struct i2c_rdwr_ioctl_data xfer;
+  uint8_t pointer = regListT::convResultReg;
+  uint8_t stale[batchMax][mapT::convResultReg::size];
+  uint8_t fromI2c[batchMax][mapT::convResultReg::size];
+  unsigned nOk = 0;
+
+  for (unsigned first = 0; first < n; first += batchMax) {
+    unsigned nChunk = (n - first < batchMax) ? (n - first) : batchMax;
+
+    //Pointer write, stale read and fresh read for each ADC of the chunk
+    for (unsigned ii = 0; ii < nChunk; ii++) {
+      msgs[3*ii].addr    = addrs[first+ii];
+      msgs[3*ii].flags   = 0;
+      msgs[3*ii].len     = sizeof(pointer);
+      msgs[3*ii].buf     = &pointer;
+      msgs[3*ii+1].addr  = addrs[first+ii];
+      msgs[3*ii+1].flags = I2C_M_RD;
+      msgs[3*ii+1].len   = sizeof(stale[ii]);
+      msgs[3*ii+1].buf   = stale[ii];
+      msgs[3*ii+2].addr  = addrs[first+ii];
+      msgs[3*ii+2].flags = I2C_M_RD;
+      msgs[3*ii+2].len   = sizeof(fromI2c[ii]);
+      msgs[3*ii+2].buf   = fromI2c[ii];
+    }
+
+    xfer.msgs  = msgs;
+    xfer.nmsgs = 3*nChunk;
+    if (ioctl(i2cFile, I2C_RDWR, &xfer) == static_cast<int>(3*nChunk)) {
+      for (unsigned ii = 0; ii < nChunk; ii++) {
+        ok[first+ii] = true;
+      }
+    } else {
+      //Find out which ADCs failed
+      for (unsigned ii = 0; ii < nChunk; ii++) {
+        xfer.msgs  = &msgs[3*ii];
+        xfer.nmsgs = 3;
+        ok[first+ii] = (ioctl(i2cFile, I2C_RDWR, &xfer) == 3);
+      }
+    }
+
+    //Decode all the conversion words of the chunk
+    for (unsigned ii = 0; ii < nChunk; ii++) {
+      if (ok[first+ii]) {
+        uint16_t word = mapT::convResultReg::read(fromI2c[ii]);
+        decodeConversion(word, conv[first+ii], alert[first+ii]);
+        nOk++;
+      }
+    }
+  }
+
+  return nOk;
+}
 
-  tempByte = ((cycleTime & 0x7)<<5) | (alertHold<<4) | (alertFlagEn<<3)
-                  | (alertPinEn<<2) | alertPolarity;
-  if (!writeByte(regListT::cfgReg, tempByte)) {
-    perror("Failed to configure ADC (0)");
-    exit(1);
+
+template <typename mapT>
+unsigned adcC02x<mapT>::batchConversion(int i2cFile, adcC02x* const* adcs, bool* ok,
+                                 unsigned n) {
+  uint8_t addrs[batchMax];
+  uint16_t conv[batchMax];
+  bool alert[batchMax];
+  unsigned nOk = 0;
+
+  for (unsigned first = 0; first < n; first += batchMax) {
+    unsigned nChunk = (n - first < batchMax) ? (n - first) : batchMax;
+    for (unsigned ii = 0; ii < nChunk; ii++) {
+      addrs[ii] = adcs[first+ii]->addr;
+    }
+    nOk += batchConversion(i2cFile, addrs, conv, alert, &ok[first], nChunk);
+    for (unsigned ii = 0; ii < nChunk; ii++) {
+      if (ok[first+ii]) {
+        adcs[first+ii]->conversion = conv[ii];
+        adcs[first+ii]->alertFlag = alert[ii];
+      }
+    }
+  }
+
+  return nOk;
+}
+
+
+template <typename mapT>
+bool adcC02x<mapT>::configure() {
+  uint8_t tempByte = 0x0;
+  configured = true;
+  errno = 0; //Short transfers leave it untouched
+
+  tempByte = mapT::cfgFields::pack(cycleTime, alertHold, alertFlagEn,
+                                   alertPinEn, alertPolarity);
+  if (!updateByte(regListT::cfgReg, tempByte)) {
+    hvLogger::log(hvLogger::devAdc, addr, hvLogger::opConfigure, errno,
+                  regListT::cfgReg, tempByte);
+    return false;
   };
 
-  if (!writeWord(regListT::lowLimReg, ((lowerLimit&0x03FF)<<2) )) {
-    perror("Failed to configure ADC (1)");
-    exit(1);
+  if (!updateWord(regListT::lowLimReg, mapT::dataField::encode(lowerLimit))) {
+    hvLogger::log(hvLogger::devAdc, addr, hvLogger::opConfigure, errno,
+                  regListT::lowLimReg, lowerLimit);
+    return false;
   };
 
-  if (!writeWord(regListT::highLimReg, ((higherLimit&0x03FF)<<2))) {
-    perror("Failed to configure ADC (2)");
-    exit(1);
+  if (!updateWord(regListT::highLimReg, mapT::dataField::encode(higherLimit))) {
+    hvLogger::log(hvLogger::devAdc, addr, hvLogger::opConfigure, errno,
+                  regListT::highLimReg, higherLimit);
+    return false;
   };
 
-  if (!writeWord(regListT::hystReg, ((hysteresis&0x03FF)<<2))) {
-    perror("Failed to configure ADC (3)");
-    exit(1);
+  if (!updateWord(regListT::hystReg, mapT::dataField::encode(hysteresis))) {
+    hvLogger::log(hvLogger::devAdc, addr, hvLogger::opConfigure, errno,
+                  regListT::hystReg, hysteresis);
+    return false;
   };
 
-  if (!writeWord(regListT::lowestConvReg, ((lowestConv&0x03FF)<<2))) {
-    perror("Failed to configure ADC (4)");
-    exit(1);
+  //The device updates the lowest and highest conversion registers at every
+  //conversion: their shadow never holds, they are always cleared
+  devRegValid[regListT::lowestConvReg] = false;
+  devRegValid[regListT::highestConvReg] = false;
+  if (!updateWord(regListT::lowestConvReg, mapT::dataField::encode(lowestConv))) {
+    hvLogger::log(hvLogger::devAdc, addr, hvLogger::opConfigure, errno,
+                  regListT::lowestConvReg, lowestConv);
+    return false;
   };
 
-  if (!writeWord(regListT::highestConvReg, ((highestConv&0x03FF)<<2))) {
-    perror("Failed to configure ADC (5)");
-    exit(1);
+  if (!updateWord(regListT::highestConvReg, mapT::dataField::encode(highestConv))) {
+    hvLogger::log(hvLogger::devAdc, addr, hvLogger::opConfigure, errno,
+                  regListT::highestConvReg, highestConv);
+    return false;
   };
 
   //Point to the conversion result register, for future readings
   if (!setPointer(regListT::convResultReg)) {
-    perror("Failed to configure ADC: setPointer");
-    exit(1);
+    hvLogger::log(hvLogger::devAdc, addr, hvLogger::opSetPointer, errno,
+                  regListT::convResultReg);
+    return false;
   };
+  return true;
 }
 
 
-bool adc101::singleNormalConversion() {
+template <typename mapT>
+bool adcC02x<mapT>::singleNormalConversion() {
+  errno = 0; //Short transfers leave it untouched
   if (!setPointer(regListT::convResultReg)) {
-    printf("Failed to switch to conversion result register\n");
+    hvLogger::log(hvLogger::devAdc, addr, hvLogger::opSetPointer, errno,
+                  regListT::convResultReg);
     return false;
   };
 
   if (!readConversion()) {
-    printf("Failed to read from ADC\n");
+    hvLogger::log(hvLogger::devAdc, addr, hvLogger::opReadConv, errno);
     return false;
   };
 
   if (!readConversion()) {
-    printf("Failed to read from ADC\n");
+    hvLogger::log(hvLogger::devAdc, addr, hvLogger::opReadConv, errno);
     return false;
   };
 
@@ -201,16 +444,27 @@ bool adc101::singleNormalConversion() {
 }
 
 
-bool adc101::sequenceNormalConversion() {
+template <typename mapT>
+bool adcC02x<mapT>::sequenceNormalConversion() {
   return false;
 }
 
 
-void adc101::setAddress(uint8_t address) {
+template <typename mapT>
+void adcC02x<mapT>::setAddress(uint8_t address) {
     addr = address;
 };
 
 
-uint8_t adc101::getAddress() {
+template <typename mapT>
+uint8_t adcC02x<mapT>::getAddress() {
     return addr;
-};
\ No newline at end of file
+};
+
+
+template <typename mapT>
+constexpr unsigned adcC02x<mapT>::batchMax;
+
+template class adcC02x<adcC02xMap<10>>;
+template class adcC02x<adcC02xMap<8>>;
+template class adcC02x<adcC02xMap<12>>;
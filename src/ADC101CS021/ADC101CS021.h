@@ -15,22 +15,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
-//#include <linux/i2c-dev.h>
-//#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
 
 #include <unistd.h>
 #include <iostream>
 #include <stdint.h>
 
+#include "../Logger/Logger.h"
+#include "../RegMap/RegMap.h"
+
+/*!
+  @brief Register map of the TI ADCx1C02x family (see the end of the file)
+  @details The 8-, 10- and 12-bit parts (ADC081C02x, ADC101C02x, ADC121C02x)
+           differ only in the position of the data in the conversion and
+           limit registers; 16-bit registers are sent MSB first.
+  @tparam bits ADC resolution: 8, 10 or 12
+*/
+template <unsigned bits>
+struct adcC02xMap {
+  static_assert(bits == 8 || bits == 10 || bits == 12, "ADCx1C02x resolution is 8, 10 or 12 bits");
+  static constexpr unsigned resolution = bits; //!< ADC resolution
+
+  //Conversion and limit registers
+  typedef regField<12 - bits, bits> dataField; //!< Conversion/limit value, 11:(12-bits)
+  typedef regField<15, 1> alertFlag;           //!< Conversion register alert flag
+
+  //Configuration register
+  typedef regField<5, 3> cycleTime;     //!< Automatic conversion period
+  typedef regField<4, 1> alertHold;     //!< Alert hold
+  typedef regField<3, 1> alertFlagEn;   //!< Alert flag enable
+  typedef regField<2, 1> alertPinEn;    //!< Alert pin enable
+  typedef regField<0, 1> alertPolarity; //!< Alert polarity
+  typedef regFields<cycleTime, alertHold, alertFlagEn, alertPinEn, alertPolarity> cfgFields; //!< Configuration register
+
+  //Alert status register
+  typedef regField<1, 1> overRange;  //!< Over-range alert
+  typedef regField<0, 1> underRange; //!< Under-range alert
+
+  //Registers
+  typedef regDesc<0, 2, msbFirst> convResultReg;  //!< Conversion Result
+  typedef regDesc<1, 1, msbFirst> alrtStsReg;     //!< Alert Status
+  typedef regDesc<2, 1, msbFirst> cfgReg;         //!< Configuration
+  typedef regDesc<3, 2, msbFirst> lowLimReg;      //!< Low Limit
+  typedef regDesc<4, 2, msbFirst> highLimReg;     //!< High Limit
+  typedef regDesc<5, 2, msbFirst> hystReg;        //!< Hysteresis
+  typedef regDesc<6, 2, msbFirst> lowestConvReg;  //!< Lowest Conversion
+  typedef regDesc<7, 2, msbFirst> highestConvReg; //!< Highest Conversion
+  typedef cfgReg byteReg;        //!< Format of the 8-bit registers
+  typedef convResultReg wordReg; //!< Format of the 16-bit registers
+};
+
 /*!
   @brief I2C-interface ADC101CS021 Class
   @details Modeled on [TI datasheet](https://www.ti.com/lit/ds/symlink/adc101c027.pdf) (version SNAS446D, Feb. 2008 – Feb. 2013)
+           Register encodings come from the adcC02xMap map; use the adc101
+           (10 bit), adc081 (8 bit) and adc121 (12 bit) instantiations.
+  @tparam mapT Register map, an adcC02xMap
   @todo Add ioctl to set the address of the ADC?
 */
-class adc101 {
+template <typename mapT>
+class adcC02x {
   public:
-    adc101(int i2cFile, uint8_t addrIn);  //!< Constructor
-    virtual ~adc101();    //!< Destructor
+    adcC02x(int i2cFile, uint8_t addrIn);  //!< Constructor
+    virtual ~adcC02x();    //!< Destructor
 
     /*!
       Automatic-Conversion mode sampling frequency
@@ -79,6 +128,12 @@ class adc101 {
       lowestConvReg  = 6,
       highestConvReg = 7 
     };
+    static_assert(mapT::convResultReg::address == convResultReg && mapT::alrtStsReg::address == alrtStsReg
+                  && mapT::cfgReg::address == cfgReg && mapT::lowLimReg::address == lowLimReg
+                  && mapT::highLimReg::address == highLimReg && mapT::hystReg::address == hystReg
+                  && mapT::lowestConvReg::address == lowestConvReg
+                  && mapT::highestConvReg::address == highestConvReg,
+                  "Register map does not match regListT");
 
     /*!
       Get conversion result and alert flag
@@ -99,13 +154,57 @@ class adc101 {
     /*!
       Start automatic conversion
       @param[in] timer Timer for the automatic conversion; use the cycleTimeT enum
+      @return false for error
     */
-    void startAutoConv(adc101::cycleTimeT timer);
+    bool startAutoConv(cycleTimeT timer);
 
     /*!
       Stop automatic conversion
+      @return false for error
+    */
+    bool stopAutoConv();
+
+    /*!
+      Get the automatic conversion rate in effect on the device
+      @return Rate; cycleTimeT::off also if the configuration register was
+              neither written nor read back
+    */
+    cycleTimeT getCycleTime();
+
+    /*!
+      Nominal period of the automatic conversion: 37.037 us (27 ksps),
+      doubled at every step of cycleTimeT
+      @param[in] timer Automatic conversion rate
+      @return Period in ns; 0 for cycleTimeT::off
+    */
+    static constexpr uint32_t cyclePeriodNs(cycleTimeT timer) {
+      return (timer == cycleTimeT::off) ? 0 : (37037u << (timer - 1));
+    }
+
+    /*!
+      Warm start: read back the configuration and limit registers and take
+      them as the current configuration, so that a following configure()
+      only writes what differs from the device
+      @return false for error; the configuration is left untouched
+    */
+    bool adoptState();
+
+    /*!
+      The configuration register read back by adoptState() holds its
+      power-on value (0x00), which configure() never writes (alert polarity
+      is active high): the device was power-cycled since it was configured.
+      NewHVIntf configures the ADC of a blank board for this purpose
+      @return false also if the register was not read back
+    */
+    bool atPowerOnDefaults();
+
+    /*!
+      Forget the shadow of the device registers and, if the ADC was
+      configured, write the whole configuration again (e.g. after a bus
+      recovery)
+      @return false for error
     */
-    void stopAutoConv();
+    bool reapplyState();
 
     /*!
       Set I2C address;
@@ -119,6 +218,44 @@ class adc101 {
     */
     uint8_t getAddress();
 
+    static constexpr unsigned batchMax = I2C_RDWR_IOCTL_MAX_MSGS / 3; //!< ADCs per I2C_RDWR ioctl
+
+    /*!
+      Read the conversion register of many ADCs on the same bus with a
+      single ioctl(I2C_RDWR) every adc101::batchMax devices: each ADC gets a
+      pointer-write message followed by two 2-byte reads, addressed
+      directly, so no I2C_SLAVE switch is needed. If the ioctl fails, its
+      ADCs are read one by one to tell the failing devices apart.
+
+      As in singleNormalConversion(), the first read is discarded: in
+      Normal Conversion mode it returns the conversion started at the end
+      of the previous access, possibly long ago, while the second one
+      returns the conversion started by the first read.
+      @param[in] i2cFile I2C bus
+      @param[in] addrs I2C addresses of the ADCs
+      @param[out] conv Conversion results, one per ADC
+      @param[out] alert Alert flags, one per ADC
+      @param[out] ok Per-ADC outcome; false for error
+      @param[in] n Number of ADCs
+      @return Number of ADCs read successfully
+    */
+    static unsigned batchConversion(int i2cFile, const uint8_t* addrs,
+                                    uint16_t* conv, bool* alert, bool* ok,
+                                    unsigned n);
+
+    /*!
+      Batched version of getConv() for many ADCs on the same bus; see
+      batchConversion(int, const uint8_t*, uint16_t*, bool*, bool*, unsigned).
+      The result of each ADC is available with updateConv().
+      @param[in] i2cFile I2C bus
+      @param[in] adcs ADC instances
+      @param[out] ok Per-ADC outcome; false for error
+      @param[in] n Number of ADCs
+      @return Number of ADCs read successfully
+    */
+    static unsigned batchConversion(int i2cFile, adcC02x* const* adcs, bool* ok,
+                                    unsigned n);
+
 
   protected:
     int i2cFile; //!< i2cFile
@@ -142,6 +279,22 @@ class adc101 {
     uint16_t lowestConv; //!< Lowest Conversion register, 11:2; 0x0FFF to clear
     uint16_t highestConv; //!< Highest Conversion register, 11:2; 0x0000 to clear
 
+    //Shadow of the device registers, to skip writes already in effect
+    uint16_t devReg[8]; //!< Last value read from or written to each register
+    bool devRegValid[8]; //!< The shadow of the register matches the device
+    bool configured; //!< configure() has been called at least once
+
+    /*!
+      Single-message transaction with the ADC, addressed with
+      ioctl(I2C_RDWR): the I2C_SLAVE of the file (e.g. the DAC of the
+      board) is never used, so no ADC access can reach another device
+      @param[in,out] buf Bytes to write or read
+      @param[in] len Number of bytes
+      @param[in] flags Message flags: 0 to write, I2C_M_RD to read
+      @return false for error (see errno)
+    */
+    bool transfer(uint8_t* buf, uint16_t len, uint16_t flags);
+
     /*!
       Read 1 byte from the ADC
       @param[out] value Reference to the conversion result buffer
@@ -162,6 +315,24 @@ class adc101 {
     */
     bool readConversion();
 
+    /*!
+      Read a register with a combined pointer-write/read transfer
+      (ioctl(I2C_RDWR) addressed to the ADC)
+      @param[in] address Register to read; use the regListT enum
+      @param[out] value Register content (MSB first on the bus)
+      @param[in] len Register size in bytes: 1 or 2
+      @return false for error
+    */
+    bool readRegister(uint8_t address, uint16_t &value, uint16_t len);
+
+    /*!
+      Extrapolate value and alert flag from the conversion register
+      @param[in] word Conversion register
+      @param[out] value Conversion result
+      @param[out] alert Alert flag
+    */
+    static void decodeConversion(uint16_t word, uint16_t &value, bool &alert);
+
     /*!
       Set pointer to read address.
       
@@ -188,6 +359,22 @@ class adc101 {
     */
     bool writeWord(uint8_t address, uint16_t value);
 
+    /*!
+      Write 1 byte to the ADC unless the register already holds it
+      @param[in] address Register to write; use the regListT enum
+      @param[in] value Value to write on the register
+      @return false for error
+    */
+    bool updateByte(uint8_t address, uint8_t value);
+
+    /*!
+      Write 2 bytes to the ADC unless the register already holds them
+      @param[in] address Register to write; use the regListT enum
+      @param[in] value Value to write on the register
+      @return false for error
+    */
+    bool updateWord(uint8_t address, uint16_t value);
+
 
     /*!
       Single conversion with ADC in Normal Conversion mode (non-Automatic).
@@ -204,13 +391,24 @@ class adc101 {
     bool sequenceNormalConversion();
 
     /*!
-      Configure the ADC registers
+      Configure the ADC registers; registers known to already hold the
+      value (see adoptState()) are not written, except the lowest and
+      highest conversion registers, which are always cleared
       @return false for error
     */
-    void configure();
+    bool configure();
 
 };
 
+typedef adcC02x<adcC02xMap<10>> adc101; //!< ADC101C021/ADC101C027, 10 bit
+typedef adcC02x<adcC02xMap<8>> adc081;  //!< ADC081C021/ADC081C027, 8 bit
+typedef adcC02x<adcC02xMap<12>> adc121; //!< ADC121C021/ADC121C027, 12 bit
+
+//Instantiated in ADC101CS021.cpp
+extern template class adcC02x<adcC02xMap<10>>;
+extern template class adcC02x<adcC02xMap<8>>;
+extern template class adcC02x<adcC02xMap<12>>;
+
 #endif /*ADC101CS021_H_*/
 
 /* Registers content
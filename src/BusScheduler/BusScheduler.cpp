@@ -0,0 +1,238 @@
+/*!
+  @file BusScheduler.cpp
+  @brief Priority-class transaction scheduler for one I2C bus
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#include "BusScheduler.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <chrono>
+
+
+busScheduler::busScheduler(int i2cFileIn) {
+  i2cFile = i2cFileIn;
+  for (unsigned ii = 0; ii < nPrio; ii++) {
+    deficitUs[ii] = 0;
+  }
+  //Default shares: control 50%, monitoring 35%, housekeeping 15%
+  quantumUs[prioT::safety]       = 0;
+  quantumUs[prioT::control]      = 5000;
+  quantumUs[prioT::monitoring]   = 3500;
+  quantumUs[prioT::housekeeping] = 1500;
+  maxTransactionUs = 0;
+  maxLockWaitUs = 0;
+  rtCfg = rtMode::defaultCfg();
+  rtPending = false;
+  rtOk = true;
+  running = true;
+  worker = std::thread(&busScheduler::workerLoop, this);
+}
+
+
+busScheduler::~busScheduler() {
+  stop();
+  i2cFile = 0;
+}
+
+
+bool busScheduler::submit(prioT prio, jobT job, jobT fail) {
+  if (prio >= nPrio) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mtx);
+  if (!running) {
+    return false;
+  }
+  queuedT entry;
+  entry.job = std::move(job);
+  entry.fail = std::move(fail);
+  queues[prio].push_back(std::move(entry));
+  cv.notify_one();
+  return true;
+}
+
+
+void busScheduler::setQuantum(prioT prio, uint32_t quantum) {
+  if (prio == prioT::safety || prio >= nPrio) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mtx);
+  quantumUs[prio] = (quantum > 0) ? quantum : 1;
+}
+
+
+bool busScheduler::setRealTime(const rtMode::cfgT& cfg) {
+  std::unique_lock<std::mutex> lock(mtx);
+  if (!running) {
+    return false;
+  }
+  rtCfg = cfg;
+  rtPending = true;
+  cv.notify_one();
+  rtDone.wait(lock, [this] { return !rtPending; });
+  return rtOk;
+}
+
+
+uint32_t busScheduler::getMaxTransactionUs() {
+  std::lock_guard<std::mutex> lock(mtx);
+  return maxTransactionUs;
+}
+
+
+uint32_t busScheduler::getMaxLockWaitUs() {
+  std::lock_guard<std::mutex> lock(mtx);
+  return maxLockWaitUs;
+}
+
+
+uint32_t busScheduler::getSafetyLatencyBoundUs() {
+  std::lock_guard<std::mutex> lock(mtx);
+  //flock() is not fair: other processes may take the bus before every job
+  return (queues[prioT::safety].size() + 1) * (maxLockWaitUs + maxTransactionUs);
+}
+
+
+void busScheduler::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    running = false;
+    cv.notify_one();
+  }
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+
+bool busScheduler::lockBus(int fd) {
+  while (flock(fd, LOCK_EX) < 0) {
+    if (errno != EINTR) {
+      perror("Failed to lock the i2c bus");
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool busScheduler::lockBus(int fd, uint32_t timeoutUs) {
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+  while (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    if (errno != EWOULDBLOCK && errno != EINTR) {
+      perror("Failed to lock the i2c bus");
+      return false;
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+    usleep(lockPollUs);
+  }
+  return true;
+}
+
+
+void busScheduler::unlockBus(int fd) {
+  flock(fd, LOCK_UN);
+}
+
+
+busScheduler::prioT busScheduler::pickClass() {
+  if (!queues[prioT::safety].empty()) {
+    return prioT::safety;
+  }
+
+  while (true) {
+    //Highest backlogged class with credit left in this round
+    for (unsigned ii = prioT::control; ii < nPrio; ii++) {
+      if (!queues[ii].empty() && deficitUs[ii] > 0) {
+        return static_cast<prioT>(ii);
+      }
+    }
+    //New round: grant the quanta; idle classes do not bank credit
+    for (unsigned ii = prioT::control; ii < nPrio; ii++) {
+      if (queues[ii].empty()) {
+        deficitUs[ii] = 0;
+      } else {
+        deficitUs[ii] += quantumUs[ii];
+      }
+    }
+  }
+}
+
+
+void busScheduler::workerLoop() {
+  std::unique_lock<std::mutex> lock(mtx);
+  while (true) {
+    cv.wait(lock, [this] {
+      if (!running || rtPending) {
+        return true;
+      }
+      for (unsigned ii = 0; ii < nPrio; ii++) {
+        if (!queues[ii].empty()) {
+          return true;
+        }
+      }
+      return false;
+    });
+
+    if (rtPending) {
+      rtOk = rtMode::apply(rtCfg);
+      rtPending = false;
+      rtDone.notify_all();
+      continue;
+    }
+
+    bool empty = true;
+    for (unsigned ii = 0; ii < nPrio; ii++) {
+      empty = empty && queues[ii].empty();
+    }
+    if (empty) {
+      break; //Stopped and drained
+    }
+
+    prioT prio = pickClass();
+    queuedT entry = std::move(queues[prio].front());
+    queues[prio].pop_front();
+    lock.unlock();
+
+    //Bus transaction, exclusive among processes; never run unlocked
+    std::chrono::steady_clock::time_point wait = std::chrono::steady_clock::now();
+    bool locked = lockBus(i2cFile);
+    for (unsigned ii = 0; !locked && ii < lockRetries; ii++) {
+      usleep(lockPollUs);
+      locked = lockBus(i2cFile);
+    }
+    if (!locked) {
+      if (entry.fail) {
+        entry.fail();
+      }
+      lock.lock();
+      continue;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    entry.job();
+    uint32_t durUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - start).count();
+    uint32_t waitUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                           start - wait).count();
+    unlockBus(i2cFile);
+
+    lock.lock();
+    if (prio != prioT::safety) {
+      deficitUs[prio] -= durUs;
+    }
+    if (durUs > maxTransactionUs) {
+      maxTransactionUs = durUs;
+    }
+    if (waitUs > maxLockWaitUs) {
+      maxLockWaitUs = waitUs;
+    }
+  }
+}
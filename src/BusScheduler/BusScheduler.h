@@ -0,0 +1,178 @@
+/*!
+  @file BusScheduler.h
+  @brief Priority-class transaction scheduler for one I2C bus
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#ifndef BUSSCHEDULER_H_
+#define BUSSCHEDULER_H_
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "../RealTime/RealTime.h"
+
+/*!
+  @brief Priority-class transaction scheduler for one I2C bus
+  @details  Runs the bus transactions submitted by NewHVIntf users, one at a
+            time, on a dedicated thread.
+
+            Arbitration:
+            - safety jobs (e.g. emergency ramp-down) are served strictly
+              first, so they wait at most for the transaction in flight and
+              for the safety jobs queued before them;
+            - control, monitoring and housekeeping share the rest of the bus
+              time with deficit round robin: each class has a quantum of bus
+              time (in us) granted at every round and is charged with the
+              measured duration of its transactions. While backlogged, a
+              class gets at least its quantum over the sum of the quanta.
+              Among the classes with credit left, the higher one goes first.
+
+            Every transaction is run holding an exclusive flock() on the bus
+            file, so that other processes (e.g. EFORO) that open the same
+            /dev/i2c-N and take busScheduler::lockBus() do not interleave
+            with it. A job is never run without the lock: if flock() keeps
+            failing, its failure job runs instead, without the bus.
+*/
+class busScheduler {
+  public:
+    /*!
+      Priority classes, highest first
+    */
+    enum prioT : uint8_t {
+      safety       = 0,
+      control      = 1,
+      monitoring   = 2,
+      housekeeping = 3
+    };
+    static constexpr unsigned nPrio = 4; //!< Number of priority classes
+    static constexpr uint32_t lockPollUs = 100; //!< Polling interval of a lockBus() with timeout, in us
+    static constexpr unsigned lockRetries = 3; //!< Further attempts to lock the bus for a job, lockPollUs apart
+
+    typedef std::function<void()> jobT; //!< Bus transaction
+
+    /*!
+      Constructor; starts the scheduler thread
+      @param[in] i2cFileIn I2C bus
+    */
+    explicit busScheduler(int i2cFileIn);
+    virtual ~busScheduler(); //!< Destructor; runs the queued jobs and stops the thread
+
+    /*!
+      Queue a transaction
+      @param[in] prio Priority class of the transaction
+      @param[in] job Transaction; it must only access the bus of this scheduler
+      @param[in] fail Run instead of the job if the bus cannot be locked
+                 (e.g. to fail its waiters); it must not access the bus
+      @return false if the scheduler is stopped; the job is not run
+    */
+    bool submit(prioT prio, jobT job, jobT fail = jobT());
+
+    /*!
+      Set the bus time granted to a class at every round. Ignored for the
+      safety class, that is never throttled.
+      @param[in] prio Priority class
+      @param[in] quantumUs Bus time, in us (at least 1)
+    */
+    void setQuantum(prioT prio, uint32_t quantumUs);
+
+    /*!
+      Apply a real-time configuration to the scheduler thread; blocks
+      until the thread has applied it
+      @param[in] cfg Real-time configuration
+      @return false if the scheduler is stopped or a setting failed
+    */
+    bool setRealTime(const rtMode::cfgT& cfg);
+
+    /*!
+      Longest transaction observed so far
+      @return Duration in us
+    */
+    uint32_t getMaxTransactionUs();
+
+    /*!
+      Longest wait observed for the bus lock held by other processes
+      @return Duration in us
+    */
+    uint32_t getMaxLockWaitUs();
+
+    /*!
+      Worst-case wait of a safety job submitted now: the transaction in
+      flight plus the safety jobs already queued, each bounded by the
+      longest transaction observed after the longest wait observed for
+      the bus lock. It holds as long as other processes do not hold the
+      lock longer than they did so far.
+      @return Latency bound in us
+    */
+    uint32_t getSafetyLatencyBoundUs();
+
+    /*!
+      Run the queued jobs and stop the thread; further submissions fail
+    */
+    void stop();
+
+    /*!
+      Take the cross-process lock of the bus (blocking)
+      @param[in] fd I2C bus file
+      @return false for error
+    */
+    static bool lockBus(int fd);
+
+    /*!
+      Take the cross-process lock of the bus, waiting at most timeoutUs
+      @param[in] fd I2C bus file
+      @param[in] timeoutUs Longest wait, in us
+      @return false for error or timeout (errno set to ETIMEDOUT)
+    */
+    static bool lockBus(int fd, uint32_t timeoutUs);
+
+    /*!
+      Release the cross-process lock of the bus
+      @param[in] fd I2C bus file
+    */
+    static void unlockBus(int fd);
+
+  protected:
+    /*!
+      Queued transaction
+    */
+    struct queuedT {
+      jobT job;  //!< Transaction
+      jobT fail; //!< Run instead of job if the bus cannot be locked; may be empty
+    };
+
+    int i2cFile; //!< I2C bus
+
+    std::deque<queuedT> queues[nPrio]; //!< Queued jobs, per class
+    int64_t deficitUs[nPrio]; //!< Bus time left to each class in this round
+    uint32_t quantumUs[nPrio]; //!< Bus time granted to each class at every round
+    uint32_t maxTransactionUs; //!< Longest transaction observed
+    uint32_t maxLockWaitUs; //!< Longest wait observed for the bus lock
+
+    rtMode::cfgT rtCfg; //!< Real-time configuration to apply
+    bool rtPending; //!< rtCfg has to be applied by the scheduler thread
+    bool rtOk; //!< Outcome of the last rtMode::apply()
+
+    std::mutex mtx; //!< Protects the members above and running
+    std::condition_variable cv; //!< Wakes up the scheduler thread
+    std::condition_variable rtDone; //!< Signals that rtCfg was applied
+    bool running; //!< Scheduler accepts jobs
+    std::thread worker; //!< Scheduler thread
+
+    /*!
+      Pick the class to serve next; at least one queue must be non-empty
+      @return Priority class
+    */
+    prioT pickClass();
+
+    /*!
+      Scheduler loop
+    */
+    void workerLoop();
+};
+
+#endif /*BUSSCHEDULER_H_*/
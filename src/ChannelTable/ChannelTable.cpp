@@ -0,0 +1,208 @@
+/*!
+  @file ChannelTable.cpp
+  @brief Contiguous structure-of-arrays state of many NewHV channels
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#include "ChannelTable.h"
+
+
+channelTable::channelT::channelT() {
+  table = nullptr;
+  idx = 0;
+}
+
+
+channelTable::channelT::channelT(channelTable* tableIn, unsigned idxIn) {
+  table = tableIn;
+  idx = idxIn;
+}
+
+
+bool channelTable::channelT::valid() {
+  return table != nullptr;
+}
+
+
+unsigned channelTable::channelT::index() {
+  return idx;
+}
+
+
+void channelTable::channelT::setBias(float vSet) {
+  table->voltageV[idx] = vSet;
+  table->voltageDac[idx] = NewHVIntf::voltageV2D(vSet);
+  table->biasSet[idx] = true;
+}
+
+
+float channelTable::channelT::getBias() {
+  return table->voltageV[idx];
+}
+
+
+float channelTable::channelT::getCurrent() {
+  return table->currentA[idx];
+}
+
+
+float channelTable::channelT::getFilteredCurrent() {
+  return table->currentFiltA[idx];
+}
+
+
+bool channelTable::channelT::getAlert() {
+  return table->alertFlag[idx];
+}
+
+
+bool channelTable::channelT::isReadOk() {
+  return table->readOk[idx];
+}
+
+
+channelTable::channelTable(int i2cFile, unsigned capacityIn) {
+  this->i2cFile = i2cFile;
+  capacity = capacityIn;
+  n = 0;
+
+  //Value-initialised: every channel starts blank
+  dacAddr = new uint8_t[capacity]();
+  adcAddr = new uint8_t[capacity]();
+  voltageV = new float[capacity]();
+  voltageDac = new uint16_t[capacity]();
+  biasSet = new bool[capacity]();
+  appliedDac = new uint16_t[capacity]();
+  dacKnown = new bool[capacity]();
+  currentAdc = new uint16_t[capacity]();
+  currentA = new float[capacity]();
+  currentFiltA = new float[capacity]();
+  filtValid = new bool[capacity]();
+  alertFlag = new bool[capacity]();
+  readOk = new bool[capacity]();
+  pendAddr = new uint8_t[capacity]();
+  pendCode = new uint16_t[capacity]();
+  pendIdx = new unsigned[capacity]();
+  pendOk = new bool[capacity]();
+}
+
+
+channelTable::~channelTable() {
+  delete[] dacAddr;
+  delete[] adcAddr;
+  delete[] voltageV;
+  delete[] voltageDac;
+  delete[] biasSet;
+  delete[] appliedDac;
+  delete[] dacKnown;
+  delete[] currentAdc;
+  delete[] currentA;
+  delete[] currentFiltA;
+  delete[] filtValid;
+  delete[] alertFlag;
+  delete[] readOk;
+  delete[] pendAddr;
+  delete[] pendCode;
+  delete[] pendIdx;
+  delete[] pendOk;
+}
+
+
+channelTable::channelT channelTable::add(uint8_t dacAddrIn, uint8_t adcAddrIn) {
+  if (n == capacity) {
+    return channelT();
+  }
+  dacAddr[n] = dacAddrIn;
+  adcAddr[n] = adcAddrIn;
+  return channelT(this, n++);
+}
+
+
+channelTable::channelT channelTable::get(unsigned idx) {
+  if (idx >= n) {
+    return channelT();
+  }
+  return channelT(this, idx);
+}
+
+
+unsigned channelTable::size() {
+  return n;
+}
+
+
+unsigned channelTable::getCapacity() {
+  return capacity;
+}
+
+
+unsigned channelTable::poll() {
+  unsigned nOk = adc101::batchConversion(i2cFile, adcAddr, currentAdc, alertFlag,
+                                         readOk, n);
+  for (unsigned ii = 0; ii < n; ii++) {
+    if (readOk[ii]) {
+      currentA[ii] = NewHVIntf::currentAdc2I(currentAdc[ii]);
+    }
+  }
+  return nOk;
+}
+
+
+void channelTable::filter(float alpha) {
+  for (unsigned ii = 0; ii < n; ii++) {
+    if (!readOk[ii]) {
+      continue;
+    }
+    if (filtValid[ii]) {
+      currentFiltA[ii] += alpha * (currentA[ii] - currentFiltA[ii]);
+    } else {
+      currentFiltA[ii] = currentA[ii];
+      filtValid[ii] = true;
+    }
+  }
+}
+
+
+unsigned channelTable::publish() {
+  //Gather the DACs to write, skipping the channels never set and the codes
+  //already in effect
+  unsigned nPend = 0;
+  for (unsigned ii = 0; ii < n; ii++) {
+    if (biasSet[ii] && (!dacKnown[ii] || appliedDac[ii] != voltageDac[ii])) {
+      pendAddr[nPend] = dacAddr[ii];
+      pendCode[nPend] = voltageDac[ii];
+      pendIdx[nPend] = ii;
+      nPend++;
+    }
+  }
+  if (nPend == 0) {
+    return 0;
+  }
+
+  unsigned nOk = ltc1669::batchWrite(i2cFile, pendAddr, NewHVIntf::dacCommand,
+                                     pendCode, pendOk, nPend);
+  for (unsigned ii = 0; ii < nPend; ii++) {
+    unsigned ch = pendIdx[ii];
+    appliedDac[ch] = pendCode[ii];
+    dacKnown[ch] = pendOk[ii];
+  }
+  return nPend - nOk;
+}
+
+
+unsigned channelTable::snapshot(statusT* out, unsigned maxN) {
+  unsigned nOut = (n < maxN) ? n : maxN;
+  for (unsigned ii = 0; ii < nOut; ii++) {
+    out[ii].dacAddr = dacAddr[ii];
+    out[ii].adcAddr = adcAddr[ii];
+    out[ii].voltageV = voltageV[ii];
+    out[ii].voltageDac = voltageDac[ii];
+    out[ii].biasApplied = dacKnown[ii] && appliedDac[ii] == voltageDac[ii];
+    out[ii].currentAdc = currentAdc[ii];
+    out[ii].currentA = currentA[ii];
+    out[ii].currentFiltA = currentFiltA[ii];
+    out[ii].alert = alertFlag[ii];
+    out[ii].readOk = readOk[ii];
+  }
+  return nOut;
+}
@@ -0,0 +1,178 @@
+/*!
+  @file ChannelTable.h
+  @brief Contiguous structure-of-arrays state of many NewHV channels
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#ifndef CHANNELTABLE_H_
+#define CHANNELTABLE_H_
+
+#include <stdint.h>
+
+#include "../NewHV/NewHV.h"
+
+/*!
+  @brief Contiguous structure-of-arrays state of many NewHV channels
+  @details  A NewHVIntf per channel keeps its state in separate heap objects
+            (the board, its ltc1669 and its adc101), so sweeping hundreds of
+            channels chases pointers. The table keeps every field of all the
+            channels of a bus in its own array, allocated once at
+            construction for the given capacity:
+            - poll() reads all the ADCs with adc101::batchConversion()
+              straight into the currentAdc and alertFlag arrays, then
+              converts them in one linear pass;
+            - filter(), publish() and snapshot() are linear passes as well;
+            - a channelT handle is only the table and an index.
+
+            Channels are never removed, so the handles stay valid as long as
+            the table. Like NewHVIntf::readAdcBatch(), the table does not
+            lock the bus: take busScheduler::lockBus() around poll() and
+            publish() if the bus is shared. Biases are not persisted nor
+            ramped down at destruction: set them to 0 and publish() first.
+
+            The table is an alternative to NewHVIntf and NewHVAsync, for
+            bulk monitoring and control of many boards; it keeps no
+            conversion timing, state file or recovery state. Do not drive
+            the same boards from both: NewHVIntf shadows the DAC code, and
+            would re-apply a stale one after an i2cPolicy recovery.
+*/
+class channelTable {
+  public:
+    /*!
+      Status of a channel, see channelTable::snapshot()
+    */
+    struct statusT {
+      uint8_t dacAddr;    //!< I2C address of the DAC
+      uint8_t adcAddr;    //!< I2C address of the ADC
+      float voltageV;     //!< Set voltage, in volts
+      uint16_t voltageDac; //!< Set voltage, in DAC units
+      bool biasApplied;   //!< The DAC holds voltageDac
+      uint16_t currentAdc; //!< Current monitor, in ADC units
+      float currentA;     //!< Current monitor, in uA
+      float currentFiltA; //!< Filtered current monitor, in uA
+      bool alert;         //!< Alert flag of the last reading
+      bool readOk;        //!< The last reading succeeded
+    };
+
+    /*!
+      @brief Handle of a channel: the table and the channel index
+    */
+    class channelT {
+      public:
+        channelT();  //!< Invalid handle
+        /*!
+          Constructor
+          @param[in] tableIn Table of the channel
+          @param[in] idxIn Channel index
+        */
+        channelT(channelTable* tableIn, unsigned idxIn);
+
+        bool valid();     //!< @return The handle refers to a channel
+        unsigned index(); //!< @return Channel index in the table
+
+        /*!
+          Set Vbias in volts and DAC units; written by channelTable::publish()
+          @param[in] vSet Voltage, in volts
+        */
+        void setBias(float vSet);
+
+        float getBias();            //!< @return Set voltage, in volts
+        float getCurrent();         //!< @return Current monitor of the last reading, in uA
+        float getFilteredCurrent(); //!< @return Filtered current monitor, in uA
+        bool getAlert();            //!< @return Alert flag of the last reading
+        bool isReadOk();            //!< @return The last reading succeeded
+
+      protected:
+        channelTable* table; //!< Table of the channel; nullptr: invalid
+        unsigned idx;        //!< Channel index
+    };
+
+    /*!
+      Constructor; allocates the arrays for all the channels
+      @param[in] i2cFile I2C bus of the channels
+      @param[in] capacityIn Maximum number of channels
+    */
+    channelTable(int i2cFile, unsigned capacityIn);
+    virtual ~channelTable(); //!< Destructor; the devices are not touched
+    channelTable(const channelTable&) = delete;            //!< Owns its arrays: not copyable
+    channelTable& operator=(const channelTable&) = delete; //!< Owns its arrays: not copyable
+
+    /*!
+      Add a channel; publish() leaves its DAC untouched until setBias()
+      @param[in] dacAddr I2C address of the DAC
+      @param[in] adcAddr I2C address of the ADC
+      @return Handle; invalid if the table is full
+    */
+    channelT add(uint8_t dacAddr, uint8_t adcAddr);
+
+    /*!
+      Get the handle of a channel
+      @param[in] idx Channel index
+      @return Handle; invalid if there is no such channel
+    */
+    channelT get(unsigned idx);
+
+    unsigned size();        //!< @return Number of channels
+    unsigned getCapacity(); //!< @return Maximum number of channels
+
+    /*!
+      Read the current monitor of all the channels with batched transfers
+      @return Number of channels read successfully
+    */
+    unsigned poll();
+
+    /*!
+      Exponential moving average of the current monitor of the channels
+      read successfully by the last poll(); the first reading of a channel
+      initialises its average
+      @param[in] alpha Weight of the new reading, 0 to 1
+    */
+    void filter(float alpha);
+
+    /*!
+      Apply Vbias of the channels set with setBias() whose DAC does not hold
+      the set code yet
+      @return Number of DACs that could not be written
+    */
+    unsigned publish();
+
+    /*!
+      Copy the status of the channels
+      @param[out] out Status, one per channel
+      @param[in] maxN Size of out
+      @return Number of channels copied
+    */
+    unsigned snapshot(statusT* out, unsigned maxN);
+
+  protected:
+    int i2cFile;       //!< I2C bus
+    unsigned capacity; //!< Maximum number of channels
+    unsigned n;        //!< Number of channels
+
+    //Addresses
+    uint8_t* dacAddr; //!< I2C address of the DAC
+    uint8_t* adcAddr; //!< I2C address of the ADC
+
+    //DAC
+    float* voltageV;      //!< Set voltage, in volts
+    uint16_t* voltageDac; //!< Set voltage, in DAC units
+    bool* biasSet;        //!< voltageDac was set with setBias()
+    uint16_t* appliedDac; //!< DAC code in effect on the device
+    bool* dacKnown;       //!< appliedDac matches the device
+
+    //ADC
+    uint16_t* currentAdc; //!< Current monitor, in ADC units
+    float* currentA;      //!< Current monitor, in uA
+    float* currentFiltA;  //!< Filtered current monitor, in uA
+    bool* filtValid;      //!< currentFiltA holds at least one reading
+    bool* alertFlag;      //!< Alert flag of the last reading
+    bool* readOk;         //!< The last reading succeeded
+
+    //Scratch of publish()
+    uint8_t* pendAddr;  //!< DACs to write
+    uint16_t* pendCode; //!< Codes to write
+    unsigned* pendIdx;  //!< Channels of the DACs to write
+    bool* pendOk;       //!< Outcome of the writes
+};
+
+#endif /*CHANNELTABLE_H_*/
@@ -0,0 +1,328 @@
+/*!
+  @file ConvTiming.cpp
+  @brief Drift-corrected timestamps of the ADC automatic conversions
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#include "ConvTiming.h"
+
+#include <math.h>
+#include <time.h>
+
+
+constexpr double convTiming::maxDrift;
+constexpr double convTiming::readSlack;
+constexpr double convTiming::driftPerObs;
+constexpr double convTiming::lockWidth;
+constexpr double convTiming::equalInit;
+constexpr double convTiming::equalWeight;
+constexpr unsigned convTiming::maxCandidates;
+constexpr unsigned convTiming::histLen;
+
+
+convTiming::convTiming(uint32_t nominalPeriodNs) {
+  reset(nominalPeriodNs);
+}
+
+
+void convTiming::reset(uint32_t nominalPeriodNs) {
+  nominalNs = nominalPeriodNs;
+  periodNs = nominalPeriodNs;
+  periodLo = nominalNs * (1 - maxDrift);
+  periodHi = nominalNs * (1 + maxDrift);
+  anchorNs = 0.0;
+  anchorIdx = 0;
+  anchorLo = anchorHi = 0.0;
+  nHist = 0;
+  histNext = 0;
+  equalRate = equalInit;
+  sinceAnchor = 0;
+  periodCap = periodHi;
+  chainLen = 0;
+  nRaw = 0;
+  rawNext = 0;
+  lastIdx = 0;
+  lastNs = -1;
+  lastConvNs = -1;
+  lastWord = 0;
+}
+
+
+double convTiming::timeOf(int64_t idx) {
+  return anchorNs + (idx - anchorIdx) * periodNs;
+}
+
+
+convTiming::resultT convTiming::update(int64_t tNs, uint16_t word) {
+  resultT res;
+  res.tNs = tNs;
+  res.skipped = 0;
+  res.duplicate = false;
+
+  //Normal mode: every reading is a new conversion
+  if (nominalNs <= 0.0) {
+    res.index = (lastNs < 0) ? 0 : ++lastIdx;
+    res.locked = true;
+    lastNs = tNs;
+    return res;
+  }
+
+  //First reading: a conversion completed somewhere in the last period
+  if (lastNs < 0) {
+    anchorIdx = 0;
+    anchorNs = tNs - periodNs / 2;
+    lastIdx = 0;
+    lastNs = tNs;
+    lastConvNs = tNs;
+    lastWord = word;
+    res.index = 0;
+    res.locked = false;
+    return res;
+  }
+
+  bool changed = (word != lastWord);
+  double gap = static_cast<double>(tNs - lastNs);
+  int64_t idx;
+  if (isLocked()) {
+    updateEqualRate(tNs, changed);
+  }
+
+  if (changed && gap < periodHi) {
+    //A change within one period: exactly one conversion between the two
+    //readings, the next one
+    idx = lastIdx + 1;
+    observe(idx, tNs);
+  } else {
+    //The grid tells how many conversions the interval holds. One within
+    //its bounds counts once more likely than a duplicate: past the point
+    //where the chance that it completed, times the chance of an equal
+    //code, exceeds the chance that it did not. A change is at least one
+    double q = 1 / (1 + equalRate);
+    double aq = anchorLo + q * (anchorHi - anchorLo);
+    double pq = periodLo + q * (periodHi - periodLo);
+    int64_t grid = lastIdx;
+    if (nHist > 0) {
+      grid = anchorIdx + static_cast<int64_t>(floor((tNs - aq) / pq));
+    }
+    idx = (grid > lastIdx) ? grid : lastIdx;
+    if (changed && idx == lastIdx) {
+      idx = lastIdx + 1;
+    }
+    sinceAnchor++;
+  }
+  int64_t newConv = idx - lastIdx;
+
+  res.index = static_cast<uint64_t>(idx);
+  res.duplicate = (newConv == 0);
+  res.skipped = (newConv > 1) ? static_cast<uint32_t>(newConv - 1) : 0;
+  lastIdx = idx;
+  res.locked = isLocked();
+  if (res.locked) {
+    //A new conversion completed between the two readings; a duplicate
+    //keeps the time of the previous one
+    int64_t tConv = llround(timeOf(idx));
+    if (res.duplicate) {
+      tConv = lastConvNs;
+    } else if (tConv > tNs) {
+      tConv = tNs;
+    } else if (tConv <= lastNs) {
+      tConv = lastNs + 1;
+    }
+    res.tNs = tConv;
+  }
+  lastConvNs = res.tNs;
+
+  lastNs = tNs;
+  lastWord = word;
+  return res;
+}
+
+
+bool convTiming::fits(int64_t idx, double b0, double b1, double& pLo, double& pHi) {
+  //Conversion idx in (b0, b1] and conversion i in its bounds: the period
+  //is between the narrowest and the widest distance of the two
+  for (unsigned ii = 0; ii < nHist; ii++) {
+    double n = static_cast<double>(idx - histIdx[ii]);
+    if ((b0 - histHi[ii]) / n > pLo) {
+      pLo = (b0 - histHi[ii]) / n;
+    }
+    if ((b1 - histLo[ii]) / n < pHi) {
+      pHi = (b1 - histLo[ii]) / n;
+    }
+  }
+  return pLo < pHi;
+}
+
+
+void convTiming::observe(int64_t idx, int64_t tNs) {
+  double slack = readSlack * nominalNs;
+  double b0 = lastNs - slack;
+  double b1 = tNs + slack;
+  rawB0[rawNext] = b0;
+  rawB1[rawNext] = b1;
+  rawMax[rawNext] = sinceAnchor + 1;
+  rawNext = (rawNext + 1) % histLen;
+  if (nRaw < histLen) {
+    nRaw++;
+  }
+
+  if (nHist == 0 || !link(b0, b1, sinceAnchor + 1)) {
+    if (nHist > 0 && chainLen < histLen && periodLo > nominalNs * (1 - maxDrift)) {
+      //A young chain broke: its labels implied too long a period. Replay
+      //the recent observations below the periods it allowed
+      periodCap = periodLo;
+      rebuild();
+    } else {
+      //Nothing fits an established chain (drift, read jitter)
+      periodCap = nominalNs * (1 + maxDrift);
+      restart(b0, b1);
+    }
+  }
+
+  //The readings keep their count: relabel the history instead
+  for (unsigned ii = 0; ii < nHist; ii++) {
+    histIdx[ii] += idx - anchorIdx;
+  }
+  anchorIdx = idx;
+  sinceAnchor = 0;
+}
+
+
+bool convTiming::link(double b0, double b1, int64_t maxConv) {
+  //The interval holds one conversion only: the period is longer. The
+  //bounds widen a little at every observation to follow the drift
+  double gap = b1 - b0 - 4 * readSlack * nominalNs;
+  double lo = periodLo - driftPerObs * nominalNs;
+  double hi = periodHi + driftPerObs * nominalNs;
+  lo = (lo > gap) ? lo : gap;
+  hi = (hi < periodCap) ? hi : periodCap;
+  if (lo >= hi) {
+    return false;
+  }
+
+  //Indexes after the anchor that the bounds and the readings allow in
+  //(b0, b1], one conversion at most per reading. Each one that fits all
+  //the history scores the share of the period bounds it keeps, times the
+  //chance that the readings in between hid the other conversions behind
+  //an equal code: the best one joins the history
+  int64_t nMin = static_cast<int64_t>(floor((b0 - anchorHi) / hi)) + 1;
+  int64_t nMax = static_cast<int64_t>(floor((b1 - anchorLo) / lo));
+  nMin = (nMin > 1) ? nMin : 1;
+  nMax = (nMax < maxConv) ? nMax : maxConv;
+  int64_t best = 0;
+  double bestScore = 0.0;
+  double bestLo = lo;
+  double bestHi = hi;
+  for (int64_t n = nMin; n <= nMax && n < nMin + maxCandidates; n++) {
+    double pLo = lo;
+    double pHi = hi;
+    if (fits(anchorIdx + n, b0, b1, pLo, pHi)) {
+      double score = (pHi - pLo) * pow(equalRate, static_cast<double>(n - 1));
+      if (best == 0 || score > bestScore) {
+        best = n;
+        bestScore = score;
+        bestLo = pLo;
+        bestHi = pHi;
+      }
+    }
+  }
+  if (best == 0) {
+    return false;
+  }
+  periodLo = bestLo;
+  periodHi = bestHi;
+  push(anchorIdx + best, b0, b1);
+  return true;
+}
+
+
+void convTiming::restart(double b0, double b1) {
+  double gap = b1 - b0 - 4 * readSlack * nominalNs;
+  nHist = 0;
+  histNext = 0;
+  chainLen = 0;
+  periodLo = (gap > nominalNs * (1 - maxDrift)) ? gap : nominalNs * (1 - maxDrift);
+  periodHi = periodCap;
+  if (periodLo >= periodHi) {
+    periodCap = nominalNs * (1 + maxDrift);
+    periodHi = periodCap;
+  }
+  push(anchorIdx, b0, b1);
+}
+
+
+void convTiming::rebuild() {
+  nHist = 0;
+  for (unsigned ii = 0; ii < nRaw; ii++) {
+    unsigned jj = (rawNext + histLen - nRaw + ii) % histLen;
+    if (nHist == 0 || !link(rawB0[jj], rawB1[jj], rawMax[jj])) {
+      restart(rawB0[jj], rawB1[jj]);
+    }
+  }
+}
+
+
+void convTiming::push(int64_t idx, double b0, double b1) {
+  //Bounds of the conversion time: the interval and the history
+  double lo = b0;
+  double hi = b1;
+  for (unsigned ii = 0; ii < nHist; ii++) {
+    double n = static_cast<double>(idx - histIdx[ii]);
+    if (histLo[ii] + n * periodLo > lo) {
+      lo = histLo[ii] + n * periodLo;
+    }
+    if (histHi[ii] + n * periodHi < hi) {
+      hi = histHi[ii] + n * periodHi;
+    }
+  }
+  histIdx[histNext] = idx;
+  histLo[histNext] = lo;
+  histHi[histNext] = hi;
+  histNext = (histNext + 1) % histLen;
+  if (nHist < histLen) {
+    nHist++;
+  }
+  chainLen++;
+
+  anchorIdx = idx;
+  anchorLo = lo;
+  anchorHi = hi;
+  periodNs = (periodLo + periodHi) / 2;
+  anchorNs = (lo + hi) / 2;
+}
+
+
+void convTiming::updateEqualRate(int64_t tNs, bool changed) {
+  //First conversion that may follow the previous reading: it counts if it
+  //certainly completed between the two readings, and the next one after
+  int64_t n = static_cast<int64_t>(floor((lastNs - anchorHi) / periodHi)) + 1;
+  if (n < 1) {
+    return;
+  }
+  if (anchorLo + n * periodLo > lastNs && anchorHi + n * periodHi <= tNs
+      && anchorLo + (n + 1) * periodLo > tNs) {
+    equalRate += equalWeight * ((changed ? 0.0 : 1.0) - equalRate);
+  }
+}
+
+
+double convTiming::getPeriodNs() {
+  return periodNs;
+}
+
+
+bool convTiming::isLocked() {
+  if (nominalNs <= 0.0) {
+    return true;
+  }
+  //Uncertainty of the grid time of the last reading
+  double width = (anchorHi - anchorLo) + (lastIdx - anchorIdx) * (periodHi - periodLo);
+  return nHist > 0 && width < lockWidth * periodNs;
+}
+
+
+int64_t convTiming::monotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
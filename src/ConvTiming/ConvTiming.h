@@ -0,0 +1,213 @@
+/*!
+  @file ConvTiming.h
+  @brief Drift-corrected timestamps of the ADC automatic conversions
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#ifndef CONVTIMING_H_
+#define CONVTIMING_H_
+
+#include <stdint.h>
+
+/*!
+  @brief Drift-corrected timestamps of the ADC automatic conversions
+  @details  In Automatic Conversion mode the ADC converts on its own
+            oscillator and the host only reads the latest conversion, so
+            the read time is not the sample time: a read can return the
+            same conversion as the previous one, or miss some.
+
+            The model tracks the conversion grid, i.e. the times at which
+            the conversion register is updated: t(k) = anchor + (k -
+            anchorIdx) * period. Every read is assigned the index of the
+            last conversion completed before it; its timestamp is the grid
+            time of that index.
+
+            The grid is kept as bounds rather than estimates. The period
+            starts within maxDrift of the nominal one of the cycleTimeT
+            rate. When the conversion register changes between two reads
+            closer than one period, exactly one conversion completed between
+            them: its index follows the previous one, and its time is in
+            the interval between the reads. The intervals of the last
+            histLen observations bound the period pairwise, and the
+            intersection of their propagations bounds the anchor, so the
+            bounds narrow to the read jitter within a few tens of reads,
+            whatever the read rate up to one period.
+
+            An unchanged register may still hide a new conversion with an
+            equal code, so an observation can be further than one index
+            from the anchor, at most one per reading. Among the indexes
+            consistent with the whole history, the one that keeps the most
+            of the period bounds, weighted by the chance of the equal codes
+            it implies, is taken. A wrong choice makes the history
+            inconsistent later: while the history is younger than histLen
+            observations, the last observations are replayed below the
+            periods it allowed, otherwise the bounds restart from the
+            nominal period.
+
+            Once the grid is locked, its time decides whether equal codes
+            between observations hold a new conversion: one counts past
+            the point of its bounds where it is more likely completed with
+            an equal code than not completed. The chance of an equal code
+            is learnt from the readings that the grid certainly gives one
+            new conversion. A changed code is always at least one new
+            conversion, never a duplicate.
+
+            The grid is locked while the uncertainty of the grid time of
+            the last reading is below lockWidth periods. Reads between 0.3
+            and 1 period apart lock within 10 to 40 reads. With a code that
+            rarely changes (low noise), reads up to 0.7 periods apart keep
+            the lock and count 1 to 3% of the readings wrong; reads close to
+            one period have too few observations to rule out a longer
+            period, and lose the lock or miscount more often. Reads
+            synchronous to the conversions cannot tell a duplicate from a
+            conversion and may not lock; slower reads never do. Unlocked
+            reads get their read time. A duplicate reading gets the
+            timestamp of the previous one.
+*/
+class convTiming {
+  public:
+    /*!
+      Timing of one reading
+    */
+    struct resultT {
+      int64_t tNs;       //!< Conversion time (grid time of the conversion read)
+      uint64_t index;    //!< Conversion index since the last reset
+      uint32_t skipped;  //!< Conversions missed since the previous reading
+      bool duplicate;    //!< Same conversion as the previous reading
+      bool locked;       //!< The grid is locked; otherwise tNs is the read time
+    };
+
+    /*!
+      Constructor
+      @param[in] nominalPeriodNs Nominal conversion period, in ns; 0: no
+                 automatic conversion (every reading is a new conversion)
+    */
+    explicit convTiming(uint32_t nominalPeriodNs = 0);
+
+    /*!
+      Restart the model (e.g. after a change of the conversion rate)
+      @param[in] nominalPeriodNs Nominal conversion period, in ns; 0: no
+                 automatic conversion
+    */
+    void reset(uint32_t nominalPeriodNs);
+
+    /*!
+      Assign a reading to a conversion and update the model
+      @param[in] tNs Time of the reading, in ns (monotonic time base)
+      @param[in] word Conversion register read
+      @return Timing of the reading
+    */
+    resultT update(int64_t tNs, uint16_t word);
+
+    double getPeriodNs(); //!< @return Estimated conversion period, in ns
+    bool isLocked();      //!< @return The grid is locked
+
+    /*!
+      Current time of the time base of the readings
+      @return CLOCK_MONOTONIC time, in ns
+    */
+    static int64_t monotonicNs();
+
+    static constexpr double maxDrift = 0.2;      //!< Period tolerance around the nominal one
+    static constexpr double readSlack = 0.02;    //!< Uncertainty of the read times, in periods
+    static constexpr double driftPerObs = 1e-5;  //!< Widening of the period bounds per observation (drift)
+    static constexpr double lockWidth = 0.25;    //!< Grid uncertainty to lock, in periods
+    static constexpr double equalInit = 0.33;    //!< Initial chance that a conversion repeats the previous code
+    static constexpr double equalWeight = 0.01;  //!< Weight of a reading in the chance of an equal code
+    static constexpr unsigned maxCandidates = 4; //!< Conversion indexes tried for an observation
+    static constexpr unsigned histLen = 64;      //!< Observations in the history
+
+  protected:
+    double nominalNs; //!< Nominal period
+    double periodNs;  //!< Estimated period: centre of its bounds
+    double periodLo;  //!< Lower bound of the period
+    double periodHi;  //!< Upper bound of the period
+    double anchorNs;  //!< Grid time of conversion anchorIdx: centre of its bounds
+    int64_t anchorIdx; //!< Conversion index of the anchor, the last one observed
+    double anchorLo;  //!< Lower bound of the time of the anchor
+    double anchorHi;  //!< Upper bound of the time of the anchor
+    int64_t histIdx[histLen]; //!< Conversion index of the observations
+    double histLo[histLen];   //!< Lower bound of the time of the observations
+    double histHi[histLen];   //!< Upper bound of the time of the observations
+    unsigned nHist;   //!< Observations in the history; 0: the grid is not anchored
+    unsigned histNext; //!< Next slot of the history
+    double equalRate; //!< Chance that a conversion repeats the previous code
+    int64_t sinceAnchor; //!< Readings since the one of the anchor
+    double periodCap; //!< Upper bound of the period for a new chain of observations
+    unsigned chainLen; //!< Observations linked since the bounds restarted
+    double rawB0[histLen];  //!< Start of the interval of the last observations
+    double rawB1[histLen];  //!< End of the interval of the last observations
+    int64_t rawMax[histLen]; //!< Conversions at most since the previous observation
+    unsigned nRaw;    //!< Observations in rawB0, rawB1 and rawMax
+    unsigned rawNext; //!< Next slot of rawB0, rawB1 and rawMax
+    int64_t lastIdx;  //!< Index of the conversion of the previous reading
+    int64_t lastNs;   //!< Time of the previous reading; -1: none
+    int64_t lastConvNs; //!< Timestamp given to the previous reading
+    uint16_t lastWord; //!< Conversion register of the previous reading
+
+    /*!
+      Grid time of a conversion
+      @param[in] idx Conversion index
+      @return Time, in ns
+    */
+    double timeOf(int64_t idx);
+
+    /*!
+      Check a conversion index of an observation against the history
+      @param[in] idx Conversion index
+      @param[in] b0 Start of the interval of the conversion
+      @param[in] b1 End of the interval of the conversion
+      @param[in,out] pLo Lower bound of the period, narrowed by the history
+      @param[in,out] pHi Upper bound of the period, narrowed by the history
+      @return Some period fits the whole history
+    */
+    bool fits(int64_t idx, double b0, double b1, double& pLo, double& pHi);
+
+    /*!
+      Narrow the bounds of the grid with an observation: the conversion idx
+      completed between the previous reading and this one
+      @param[in] idx Conversion index
+      @param[in] tNs Time of the reading
+    */
+    void observe(int64_t idx, int64_t tNs);
+
+    /*!
+      Link an observation to the history, with the most likely conversion
+      index after the anchor that fits it
+      @param[in] b0 Start of the interval of the conversion
+      @param[in] b1 End of the interval of the conversion
+      @param[in] maxConv Conversions at most since the anchor
+      @return Some index fits; otherwise the model is unchanged
+    */
+    bool link(double b0, double b1, int64_t maxConv);
+
+    /*!
+      Restart the bounds from one observation, below periodCap
+      @param[in] b0 Start of the interval of the conversion
+      @param[in] b1 End of the interval of the conversion
+    */
+    void restart(double b0, double b1);
+
+    /*!
+      Replay the last observations below periodCap
+    */
+    void rebuild();
+
+    /*!
+      Append a conversion to the history and move the anchor to it
+      @param[in] idx Conversion index
+      @param[in] b0 Start of the interval of the conversion
+      @param[in] b1 End of the interval of the conversion
+    */
+    void push(int64_t idx, double b0, double b1);
+
+    /*!
+      Update the chance of an equal code with a reading that the grid
+      certainly gives one new conversion; the grid must be locked
+      @param[in] tNs Time of the reading
+      @param[in] changed The conversion register changed
+    */
+    void updateEqualRate(int64_t tNs, bool changed);
+};
+
+#endif /*CONVTIMING_H_*/
@@ -0,0 +1,94 @@
+/*!
+  @file I2CPolicy.cpp
+  @brief Retry and recovery policy for the transactions on one I2C bus
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#include "I2CPolicy.h"
+
+#include <fcntl.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+
+#include "../BusScheduler/BusScheduler.h"
+#include "../Logger/Logger.h"
+
+
+i2cPolicy::i2cPolicy(const std::string& deviceIn, int i2cFileIn, uint8_t slaveAddrIn) {
+  device = deviceIn;
+  i2cFile = i2cFileIn;
+  slaveAddr = slaveAddrIn;
+  //Default: worst case 1 + 3 attempts and 0.7 ms of backoff per operation,
+  //100 ms for the bus lock of a recovery
+  cfg.maxRetries = 3;
+  cfg.backoffUs = 100;
+  cfg.backoffMaxUs = 400;
+  cfg.stuckThreshold = 3;
+  cfg.lockTimeoutUs = 100000;
+  consecutiveFails = 0;
+  nRetries = 0;
+  nRecoveries = 0;
+}
+
+
+i2cPolicy::~i2cPolicy() {
+  i2cFile = 0;
+}
+
+
+void i2cPolicy::setCfg(const cfgT& cfgIn) {
+  cfg = cfgIn;
+}
+
+
+void i2cPolicy::addReapply(std::function<bool()> fn) {
+  reapply.push_back(fn);
+}
+
+
+i2cPolicy::errT i2cPolicy::recover() {
+  nRecoveries++;
+
+  //Re-open the device on the same descriptor, shared by all the drivers
+  int fd = open(device.c_str(), O_RDWR);
+  if (fd < 0) {
+    hvLogger::log(hvLogger::devBus, slaveAddr, hvLogger::opRecover, errno, 0);
+    return errT::recoveryFailed;
+  }
+  if (dup2(fd, i2cFile) < 0) {
+    hvLogger::log(hvLogger::devBus, slaveAddr, hvLogger::opRecover, errno, 1);
+    close(fd);
+    return errT::recoveryFailed;
+  }
+  close(fd);
+
+  //Per-open-file settings are lost with the old file
+  if (ioctl(i2cFile, I2C_SLAVE, slaveAddr) < 0) {
+    hvLogger::log(hvLogger::devBus, slaveAddr, hvLogger::opRecover, errno, 2);
+    return errT::recoveryFailed;
+  }
+  if (!busScheduler::lockBus(i2cFile, cfg.lockTimeoutUs)) {
+    hvLogger::log(hvLogger::devBus, slaveAddr, hvLogger::opRecover, errno, 3);
+    return (errno == ETIMEDOUT) ? errT::failed : errT::recoveryFailed;
+  }
+
+  //Shadowed state
+  errT err = errT::ok;
+  for (std::function<bool()>& fn : reapply) {
+    if (!fn()) {
+      hvLogger::log(hvLogger::devBus, slaveAddr, hvLogger::opRecover, errno, 4);
+      err = errT::recoveryFailed;
+    }
+  }
+  return err;
+}
+
+
+uint32_t i2cPolicy::getRetries() {
+  return nRetries;
+}
+
+
+uint32_t i2cPolicy::getRecoveries() {
+  return nRecoveries;
+}
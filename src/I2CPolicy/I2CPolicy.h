@@ -0,0 +1,169 @@
+/*!
+  @file I2CPolicy.h
+  @brief Retry and recovery policy for the transactions on one I2C bus
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#ifndef I2CPOLICY_H_
+#define I2CPOLICY_H_
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+/*!
+  @brief Retry and recovery policy for the transactions on one I2C bus
+  @details  Wraps the bus operations of the drivers (that return false for
+            error) and reports the outcome as an error code; it never exits
+            the process.
+
+            - A failed operation is retried up to cfgT::maxRetries times,
+              waiting cfgT::backoffUs, doubled at each retry up to
+              cfgT::backoffMaxUs, so its cost is bounded.
+            - The bus is considered stuck if an operation keeps failing with
+              ETIMEDOUT (the adapter could not get the bus) or after
+              cfgT::stuckThreshold consecutive failed operations. It is
+              then recovered: the device is re-opened on the same file
+              descriptor (so every driver holding it keeps working), the
+              slave address and the bus lock are re-asserted and the
+              shadowed state registered with addReapply() is written again.
+              The operation is then attempted once more. The bus lock is
+              waited for at most cfgT::lockTimeoutUs, so that a recovery
+              never blocks its scheduler job without limit.
+
+            Not thread-safe: use it from the thread that owns the bus (e.g.
+            the busScheduler jobs).
+*/
+class i2cPolicy {
+  public:
+    /*!
+      Outcome of an operation
+    */
+    enum errT : int8_t {
+      ok             =  0, //!< Success, possibly after retries or a recovery
+      failed         = -1, //!< Failed after all the retries
+      busStuck       = -2, //!< Bus recovered, but the operation still fails
+      recoveryFailed = -3  //!< Bus stuck and re-opening it failed
+    };
+
+    /*!
+      Policy configuration
+    */
+    struct cfgT {
+      uint8_t maxRetries;     //!< Retries after the first attempt
+      uint32_t backoffUs;     //!< Wait before the first retry, in us
+      uint32_t backoffMaxUs;  //!< Maximum wait between retries, in us
+      uint8_t stuckThreshold; //!< Consecutive failed operations for a stuck bus
+      uint32_t lockTimeoutUs; //!< Longest wait for the bus lock during a recovery, in us
+    };
+
+    /*!
+      Constructor
+      @param[in] deviceIn I2C device path (e.g. /dev/i2c-1), to re-open it
+      @param[in] i2cFileIn I2C bus file, kept across recoveries
+      @param[in] slaveAddrIn Default slave address (I2C_SLAVE)
+    */
+    i2cPolicy(const std::string& deviceIn, int i2cFileIn, uint8_t slaveAddrIn);
+    virtual ~i2cPolicy(); //!< Destructor
+
+    /*!
+      Set the configuration
+      @param[in] cfgIn Policy configuration
+    */
+    void setCfg(const cfgT& cfgIn);
+
+    /*!
+      Register the re-application of a shadowed state after a recovery
+      @param[in] fn Writes the state again; returns false for error
+    */
+    void addReapply(std::function<bool()> fn);
+
+    /*!
+      Run an operation with retries and, if the bus is stuck, recovery
+      @param[in] op Bus operation; returns false for error and sets errno
+      @return Outcome
+    */
+    template <typename opT>
+    errT run(opT op);
+
+    /*!
+      Re-open the bus, re-assert the slave address and the bus lock and
+      write the shadowed state again
+      @return ok, failed if the bus lock is not taken within
+              cfgT::lockTimeoutUs, or recoveryFailed
+    */
+    errT recover();
+
+    uint32_t getRetries();    //!< @return Retries so far
+    uint32_t getRecoveries(); //!< @return Recoveries so far
+
+  protected:
+    std::string device; //!< I2C device path
+    int i2cFile;        //!< I2C bus file
+    uint8_t slaveAddr;  //!< Default slave address
+    cfgT cfg;           //!< Policy configuration
+    std::vector<std::function<bool()>> reapply; //!< Shadowed-state writers
+
+    uint8_t consecutiveFails; //!< Operations failed in a row
+    uint32_t nRetries;        //!< Retries so far
+    uint32_t nRecoveries;     //!< Recoveries so far
+
+    /*!
+      Attempt an operation up to 1 + cfgT::maxRetries times
+      @param[in] op Bus operation
+      @param[out] timedOut The last failure was ETIMEDOUT
+      @return false for error
+    */
+    template <typename opT>
+    bool attempt(opT& op, bool &timedOut);
+};
+
+
+template <typename opT>
+bool i2cPolicy::attempt(opT& op, bool &timedOut) {
+  uint32_t backoff = cfg.backoffUs;
+  for (unsigned ii = 0; ii <= cfg.maxRetries; ii++) {
+    if (ii > 0) {
+      nRetries++;
+      usleep(backoff);
+      backoff = (2*backoff < cfg.backoffMaxUs) ? 2*backoff : cfg.backoffMaxUs;
+    }
+    errno = 0;
+    if (op()) {
+      return true;
+    }
+    timedOut = (errno == ETIMEDOUT);
+  }
+  return false;
+}
+
+
+template <typename opT>
+i2cPolicy::errT i2cPolicy::run(opT op) {
+  bool timedOut = false;
+  if (attempt(op, timedOut)) {
+    consecutiveFails = 0;
+    return errT::ok;
+  }
+
+  consecutiveFails++;
+  if (!timedOut && consecutiveFails < cfg.stuckThreshold) {
+    return errT::failed;
+  }
+
+  //Stuck bus
+  errT err = recover();
+  if (err != errT::ok) {
+    return err;
+  }
+  if (attempt(op, timedOut)) {
+    consecutiveFails = 0;
+    return errT::ok;
+  }
+  return errT::busStuck;
+}
+
+#endif /*I2CPOLICY_H_*/
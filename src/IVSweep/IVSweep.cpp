@@ -0,0 +1,180 @@
+/*!
+  @file IVSweep.cpp
+  @brief Pipelined IV-curve sweep engine
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#include "IVSweep.h"
+
+#include <math.h>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+
+ivSweep::ivSweep() {
+  out = nullptr;
+  aborted = false;
+}
+
+
+ivSweep::~ivSweep() {
+  if (out != nullptr) {
+    fclose(out);
+  }
+}
+
+
+std::vector<float> ivSweep::ramp(float start, float stop, float step) {
+  std::vector<float> voltages;
+  step = fabsf(step);
+  if (step == 0.0) {
+    voltages.push_back(start);
+    return voltages;
+  }
+  float dir = (stop >= start) ? 1.0 : -1.0;
+  unsigned nSteps = static_cast<unsigned>(fabsf(stop - start) / step + 0.5);
+  for (unsigned ii = 0; ii <= nSteps; ii++) {
+    voltages.push_back(start + dir * step * ii);
+  }
+  return voltages;
+}
+
+
+void ivSweep::addBus(NewHVAsync* bus, const std::vector<unsigned>& channels) {
+  busT b;
+  b.bus = bus;
+  b.channels = channels;
+  buses.push_back(b);
+}
+
+
+bool ivSweep::run(const sweepCfgT& cfg, const char* outFile) {
+  if (cfg.voltages.empty() || cfg.nSamples == 0) {
+    printf("Empty IV sweep\n");
+    return false;
+  }
+
+  out = fopen(outFile, "w");
+  if (out == nullptr) {
+    perror("Failed to open the IV sweep output file");
+    return false;
+  }
+  fprintf(out, "#bus ch point vSet(V) iMean(uA) iRms(uA) nSamples alert\n");
+  aborted = false;
+
+  //One thread per bus
+  std::vector<std::thread> threads;
+  std::unique_ptr<bool[]> results(new bool[buses.size()]);
+  for (unsigned ii = 0; ii < buses.size(); ii++) {
+    threads.push_back(std::thread([this, ii, &cfg, &results] {
+      results[ii] = sweepBus(ii, cfg);
+    }));
+  }
+
+  bool bSuccess = true;
+  for (unsigned ii = 0; ii < threads.size(); ii++) {
+    threads[ii].join();
+    bSuccess = bSuccess && results[ii];
+  }
+
+  fclose(out);
+  out = nullptr;
+  return bSuccess && !aborted;
+}
+
+
+void ivSweep::abort() {
+  aborted = true;
+}
+
+
+void ivSweep::setAll(busT& bus, float vSet, std::vector<std::future<bool>>& done) {
+  done.clear();
+  for (unsigned ch : bus.channels) {
+    done.push_back(bus.bus->setBias(ch, vSet));
+  }
+}
+
+
+bool ivSweep::waitAll(std::vector<std::future<bool>>& done) {
+  bool bSuccess = true;
+  for (std::future<bool>& fut : done) {
+    bSuccess = fut.get() && bSuccess;
+  }
+  return bSuccess;
+}
+
+
+bool ivSweep::sweepBus(unsigned busIdx, const sweepCfgT& cfg) {
+  busT& bus = buses[busIdx];
+  unsigned nCh = bus.channels.size();
+  bool bSuccess = true;
+
+  //Per-channel accumulators of the current point
+  std::vector<double> sum(nCh), sumSq(nCh);
+  std::vector<uint32_t> nOk(nCh);
+  std::vector<uint8_t> alert(nCh);
+  std::vector<std::future<bool>> biasDone;
+  std::vector<std::future<NewHVAsync::readingT>> reads(nCh);
+
+  setAll(bus, cfg.voltages[0], biasDone);
+  bSuccess = waitAll(biasDone) && bSuccess;
+  std::chrono::steady_clock::time_point applied = std::chrono::steady_clock::now();
+
+  for (unsigned pt = 0; pt < cfg.voltages.size() && !aborted; pt++) {
+    std::this_thread::sleep_until(applied + std::chrono::microseconds(cfg.settleUs));
+
+    for (unsigned ch = 0; ch < nCh; ch++) {
+      sum[ch] = 0.0;
+      sumSq[ch] = 0.0;
+      nOk[ch] = 0;
+      alert[ch] = 0;
+    }
+
+    //Priming read cycle plus the samples; each cycle reads all the channels
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    for (unsigned smp = 0; smp <= cfg.nSamples; smp++) {
+      std::this_thread::sleep_until(next);
+      next += std::chrono::microseconds(cfg.intervalUs);
+      for (unsigned ch = 0; ch < nCh; ch++) {
+        reads[ch] = bus.bus->readCurrent(bus.channels[ch]);
+      }
+      for (unsigned ch = 0; ch < nCh; ch++) {
+        NewHVAsync::readingT rd = reads[ch].get();
+        if (smp == 0 || !rd.ok) {
+          continue;
+        }
+        sum[ch] += rd.currentUa;
+        sumSq[ch] += rd.currentUa * rd.currentUa;
+        nOk[ch]++;
+        alert[ch] |= rd.alert;
+      }
+    }
+
+    //Program the next point while this one is averaged and streamed
+    float vNext = (pt + 1 < cfg.voltages.size()) ? cfg.voltages[pt+1] : cfg.finalV;
+    setAll(bus, vNext, biasDone);
+
+    {
+      std::lock_guard<std::mutex> lock(outMtx);
+      for (unsigned ch = 0; ch < nCh; ch++) {
+        double mean = 0.0, rms = 0.0;
+        if (nOk[ch] > 0) {
+          mean = sum[ch] / nOk[ch];
+          rms = sqrt(fmax(sumSq[ch] / nOk[ch] - mean * mean, 0.0));
+        } else {
+          bSuccess = false;
+        }
+        fprintf(out, "%u %u %u %.3f %.4f %.4f %u %u\n", busIdx, bus.channels[ch],
+                pt, cfg.voltages[pt], mean, rms, nOk[ch], alert[ch]);
+      }
+      fflush(out);
+    }
+
+    bSuccess = waitAll(biasDone) && bSuccess;
+    applied = std::chrono::steady_clock::now();
+  }
+
+  return bSuccess;
+}
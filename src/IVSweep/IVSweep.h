@@ -0,0 +1,127 @@
+/*!
+  @file IVSweep.h
+  @brief Pipelined IV-curve sweep engine
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#ifndef IVSWEEP_H_
+#define IVSWEEP_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+#include "../NewHVAsync/NewHVAsync.h"
+
+/*!
+  @brief Pipelined IV-curve sweep engine
+  @details  Steps the bias of many boards through a list of voltages and
+            records the current monitor at each step, without any HV cycle
+            between the points.
+
+            All the channels of a bus move together, so the settle time is
+            paid once per point and per bus, and the read cycles of a bus
+            are batched by NewHVAsync. Each bus is swept by its own thread,
+            so the buses proceed in parallel.
+
+            Per point and per bus:
+            1. wait for the settle time since the bias was applied;
+            2. one read cycle is discarded (in Normal Conversion mode it
+               returns a conversion started before the settle time), then
+               sweepCfgT::nSamples read cycles are taken;
+            3. the DAC codes of the next point are queued right away, and
+               the samples are averaged and streamed to the output file
+               while the next point is programmed and settles.
+
+            Output file, one line per channel and point:
+            `bus ch point vSet(V) iMean(uA) iRms(uA) nSamples alert`
+*/
+class ivSweep {
+  public:
+    /*!
+      Sweep configuration
+    */
+    struct sweepCfgT {
+      std::vector<float> voltages; //!< Bias points, in volts
+      uint32_t settleUs;    //!< Settle time after each bias step, in us
+      uint32_t nSamples;    //!< Readings averaged at each point
+      uint32_t intervalUs;  //!< Interval between readings, in us
+      float finalV;         //!< Bias applied at the end of the sweep, in volts
+    };
+
+    ivSweep(); //!< Constructor
+    virtual ~ivSweep(); //!< Destructor
+
+    /*!
+      Voltage list from a start/stop/step description; stop is included
+      if reached within half a step
+      @param[in] start First voltage, in volts
+      @param[in] stop Last voltage, in volts
+      @param[in] step Voltage step, in volts; its sign is ignored
+      @return Voltage list
+    */
+    static std::vector<float> ramp(float start, float stop, float step);
+
+    /*!
+      Add the channels of one bus to the sweep. The bus is not owned and
+      must outlive the sweep.
+      @param[in] bus Asynchronous interface of the bus
+      @param[in] channels Channel indexes on that bus
+    */
+    void addBus(NewHVAsync* bus, const std::vector<unsigned>& channels);
+
+    /*!
+      Run the sweep on all the buses; returns when all of them are done
+      @param[in] cfg Sweep configuration
+      @param[in] outFile Output file path
+      @return false for error on any channel
+    */
+    bool run(const sweepCfgT& cfg, const char* outFile);
+
+    /*!
+      Stop a running sweep after the point in progress; the bias writes
+      already queued complete. Async-signal-safe.
+    */
+    void abort();
+
+  protected:
+    /*!
+      Channels of one bus
+    */
+    struct busT {
+      NewHVAsync* bus;                //!< Asynchronous interface of the bus
+      std::vector<unsigned> channels; //!< Channel indexes on that bus
+    };
+
+    std::vector<busT> buses; //!< Buses in the sweep
+    FILE* out;               //!< Output file
+    std::atomic<bool> aborted; //!< abort() was called during run()
+    std::mutex outMtx;       //!< Serialises the output of the buses
+
+    /*!
+      Sweep one bus
+      @param[in] busIdx Index in ivSweep::buses
+      @param[in] cfg Sweep configuration
+      @return false for error on any channel
+    */
+    bool sweepBus(unsigned busIdx, const sweepCfgT& cfg);
+
+    /*!
+      Queue the same bias on all the channels of a bus
+      @param[in] bus Channels of the bus
+      @param[in] vSet Voltage to set, in volts
+      @param[out] done Completion of each write
+    */
+    static void setAll(busT& bus, float vSet, std::vector<std::future<bool>>& done);
+
+    /*!
+      Wait for the bias writes of a bus
+      @param[in] done Completion of each write
+      @return false for error on any channel
+    */
+    static bool waitAll(std::vector<std::future<bool>>& done);
+};
+
+#endif /*IVSWEEP_H_*/
@@ -6,46 +6,100 @@
 
 #include "LTC1669.h"
 
-ltc1669::ltc1669(int i2cFile, uint8_t addrIn) {
-  i2cFile = i2cFile;
+template <typename mapT>
+ltcDac<mapT>::ltcDac(int i2cFile, uint8_t addrIn) {
+  this->i2cFile = i2cFile;
   addr = addrIn;
 }
 
-ltc1669::~ltc1669() {
+template <typename mapT>
+ltcDac<mapT>::~ltcDac() {
   i2cFile = 0;
 }
 
-bool ltc1669::writeWord(uint8_t command, uint16_t value) {
-    uint8_t buffer[3];
+template <typename mapT>
+bool ltcDac<mapT>::writeWord(uint8_t command, uint16_t value) {
+    // Command, LSB, MSB
+    typename mapT::dataReg::frameT buffer =
+      mapT::dataReg::write(command, mapT::dataField::encode(value));
     
-    buffer[0] = command;              // Command
-    buffer[1] = value & 0xFF;         // LSB
-    buffer[2] = (value >> 8) & 0xFF;  // MSB
-    
-    if (write(i2cFile, buffer, sizeof(buffer)) != sizeof(buffer)) {
-        std::cout << "Failed to write to I2C device: command 0x" << std::hex << command << " and value 0x" << value << std::dec << std::endl;
-        //exit(1);
+    if (!writeTo(i2cFile, addr, buffer.data, sizeof(buffer.data))) {
+        hvLogger::log(hvLogger::devDac, addr, hvLogger::opWriteWord,
+                      errno, command, value);
         return false;
     }
     return true;
 }
 
 
-bool ltc1669::writeCommand(uint8_t command) {
-    if (write(i2cFile, &command, sizeof(command)) != sizeof(command)) {
-        std::cout << "Failed to write to I2C device: command 0x" << std::hex << command << std::dec << std::endl;
-        //exit(1);
+template <typename mapT>
+bool ltcDac<mapT>::writeCommand(uint8_t command) {
+    if (!writeTo(i2cFile, addr, &command, sizeof(command))) {
+        hvLogger::log(hvLogger::devDac, addr, hvLogger::opWriteCommand,
+                      errno, command);
         return false;
     }
     return true;
 }
 
 
-void ltc1669::setAddress(uint8_t address) {
+template <typename mapT>
+bool ltcDac<mapT>::writeTo(int i2cFile, uint8_t address, uint8_t* buf, uint16_t len) {
+    struct i2c_msg msg;
+    struct i2c_rdwr_ioctl_data xfer;
+    msg.addr  = address;
+    msg.flags = 0;
+    msg.len   = len;
+    msg.buf   = buf;
+    xfer.msgs  = &msg;
+    xfer.nmsgs = 1;
+
+    errno = 0; //Short transfers leave it untouched
+    return ioctl(i2cFile, I2C_RDWR, &xfer) == 1;
+}
+
+
+template <typename mapT>
+void ltcDac<mapT>::setAddress(uint8_t address) {
     addr = address;
 };
 
 
-uint8_t ltc1669::getAddress() {
+template <typename mapT>
+uint8_t ltcDac<mapT>::getAddress() {
     return addr;
 };
+
+
+template <typename mapT>
+unsigned ltcDac<mapT>::batchWrite(int i2cFile, const uint8_t* addrs, uint8_t command,
+                                  const uint16_t* values, bool* ok, unsigned n) {
+  struct i2c_msg msg;
+  struct i2c_rdwr_ioctl_data xfer;
+  unsigned nOk = 0;
+
+  for (unsigned ii = 0; ii < n; ii++) {
+    typename mapT::dataReg::frameT buffer =
+      mapT::dataReg::write(command, mapT::dataField::encode(values[ii]));
+    msg.addr  = addrs[ii];
+    msg.flags = 0;
+    msg.len   = sizeof(buffer.data);
+    msg.buf   = buffer.data;
+    xfer.msgs  = &msg;
+    xfer.nmsgs = 1;
+
+    errno = 0;
+    ok[ii] = (ioctl(i2cFile, I2C_RDWR, &xfer) == 1);
+    if (ok[ii]) {
+      nOk++;
+    } else {
+      hvLogger::log(hvLogger::devDac, addrs[ii], hvLogger::opWriteWord, errno,
+                    command, values[ii]);
+    }
+  }
+
+  return nOk;
+}
+
+
+template class ltcDac<ltc1669Map>;
@@ -15,23 +15,56 @@
 //#include <sys/ioctl.h>
 
 #include <unistd.h>
+#include <errno.h>
 #include <iostream>
 #include <stdint.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+
+#include "../Logger/Logger.h"
+#include "../RegMap/RegMap.h"
+
+/*!
+  @brief Register map of the LTC1669-like I2C DACs (see the end of the file)
+  @details A command byte followed by the data word, LSB first.
+  @tparam bits DAC resolution
+*/
+template <unsigned bits>
+struct ltcDacMap {
+  static constexpr unsigned resolution = bits; //!< DAC resolution
+
+  typedef regField<0, bits> dataField; //!< DAC code
+
+  //Command byte
+  typedef regField<2, 1> bandGap;    //!< Internal band-gap reference
+  typedef regField<1, 1> shutDown;   //!< Power-down mode
+  typedef regField<0, 1> syncUpdate; //!< Update on sync
+  typedef regFields<bandGap, shutDown, syncUpdate> cmdFields; //!< Command byte
+
+  typedef regDesc<0, 2, lsbFirst> dataReg; //!< Data word, after the command byte
+};
 
 /*!
   @brief I2C-interface LTC1669 Class
   @details  Modeled on [analog.com datasheet](https://www.analog.com/media/en/technical-documentation/data-sheets/1669fa.pdf) (v.1669fa).
             Implemented only a subset of functions.
             No _SYNC Address_ / _Quick Command_ implemented.
+            Data and command encodings come from the ltcDacMap map; use the
+            ltc1669 (10 bit) instantiation.
+  @tparam mapT Register map, an ltcDacMap
   @todo Add ioctl to set the address of the DAC?
 */
-class ltc1669 {
+template <typename mapT>
+class ltcDac {
   public:
-    ltc1669(int i2cFile, uint8_t addrIn); //!< Constructor
-    virtual ~ltc1669();   //!< Destructor
+    ltcDac(int i2cFile, uint8_t addrIn); //!< Constructor
+    virtual ~ltcDac();   //!< Destructor
 
     /*!
-      Write a 2 bytes to the DAC (only the 10-LSb are valid)
+      Write a 2 bytes to the DAC (only the mapT::resolution LSb are valid).
+      The DAC is addressed by each transfer (ioctl(I2C_RDWR)), not by the
+      I2C_SLAVE of the file, so the DACs of many boards can share a file.
       @param[in] command Command byte, as per datasheet
       @param[in] value Voltage value (2 bytes, unsigned)
       @return False for error
@@ -57,13 +90,44 @@ class ltc1669 {
     */
     uint8_t getAddress();
 
+    /*!
+      Write the code of many DACs on the same bus, each with its own
+      ioctl(I2C_RDWR) addressed directly, so no I2C_SLAVE switch is needed.
+      Every DAC gets a whole transaction, terminated by its stop condition,
+      so that it updates the output as with writeWord().
+      @param[in] i2cFile I2C bus
+      @param[in] addrs I2C addresses of the DACs
+      @param[in] command Command byte, as per datasheet
+      @param[in] values DAC codes, one per DAC
+      @param[out] ok Per-DAC outcome; false for error
+      @param[in] n Number of DACs
+      @return Number of DACs written successfully
+    */
+    static unsigned batchWrite(int i2cFile, const uint8_t* addrs, uint8_t command,
+                               const uint16_t* values, bool* ok, unsigned n);
+
   protected:
     int i2cFile; //!< i2cFile
     uint8_t addr; //!< I2C address
     const uint8_t syncAddr = 0xFC; //!< I2C address to sync all connected DACs
 
+    /*!
+      Write a whole transaction to a device with ioctl(I2C_RDWR)
+      @param[in] i2cFile I2C bus
+      @param[in] address I2C address of the device
+      @param[in] buf Bytes to write
+      @param[in] len Number of bytes
+      @return false for error (see errno)
+    */
+    static bool writeTo(int i2cFile, uint8_t address, uint8_t* buf, uint16_t len);
+
 };
 
+typedef ltcDacMap<10> ltc1669Map;  //!< LTC1669 register map
+typedef ltcDac<ltc1669Map> ltc1669; //!< LTC1669, 10 bit
+
+extern template class ltcDac<ltc1669Map>;
+
 #endif /*LTC1669_H_*/
 
 /*
@@ -0,0 +1,200 @@
+/*!
+  @file Logger.cpp
+  @brief Asynchronous lock-free binary logger for the I2C paths
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#include "Logger.h"
+
+#include <string.h>
+#include <time.h>
+#include <chrono>
+
+constexpr uint32_t hvLogger::ringSize;
+constexpr uint32_t hvLogger::drainPeriodMs;
+
+static const char* const devNames[] = {"DAC", "ADC", "NewHV", "bus"}; //!< Names of hvLogger::devT
+static const char* const opNames[] = {"writeWord", "writeCommand", "setPointer",
+                                      "readConversion", "applyBias", "configure",
+                                      "recover", "saveState"}; //!< Names of hvLogger::opT
+
+
+hvLogger::hvLogger() {
+  out = stderr;
+  running = false;
+  dropped = 0;
+  droppedReported = 0;
+}
+
+
+hvLogger::~hvLogger() {
+  stop();
+}
+
+
+hvLogger::ringGuardT::~ringGuardT() {
+  if (ring != nullptr) {
+    ring->inUse.store(false, std::memory_order_release);
+  }
+}
+
+
+hvLogger& hvLogger::instance() {
+  static hvLogger logger;
+  return logger;
+}
+
+
+hvLogger::ringT* hvLogger::threadRing() {
+  static thread_local ringGuardT guard = {nullptr};
+  if (guard.ring != nullptr) {
+    return guard.ring;
+  }
+
+  //First record of this thread: reuse the ring of an exited thread, if any
+  std::lock_guard<std::mutex> lock(mtx);
+  for (std::unique_ptr<ringT>& ring : rings) {
+    if (!ring->inUse.load(std::memory_order_acquire)) {
+      ring->inUse.store(true, std::memory_order_relaxed);
+      guard.ring = ring.get();
+      return guard.ring;
+    }
+  }
+  if (rings.size() > UINT8_MAX) {
+    return nullptr;
+  }
+  std::unique_ptr<ringT> ring(new ringT);
+  ring->head = 0;
+  ring->tail = 0;
+  ring->inUse = true;
+  ring->id = rings.size();
+  guard.ring = ring.get();
+  rings.push_back(std::move(ring));
+  return guard.ring;
+}
+
+
+void hvLogger::log(devT dev, uint8_t addr, opT op, int err,
+                   uint32_t val0, uint32_t val1) {
+  hvLogger& lg = instance();
+  ringT* ring = lg.threadRing();
+  if (ring == nullptr) {
+    lg.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  uint32_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) >= ringSize) {
+    lg.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  recordT& rec = ring->rec[head & (ringSize - 1)];
+  rec.tNs  = static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+  rec.val0 = val0;
+  rec.val1 = val1;
+  rec.err  = err;
+  rec.dev  = dev;
+  rec.addr = addr;
+  rec.op   = op;
+  rec.ring = ring->id;
+  ring->head.store(head + 1, std::memory_order_release);
+
+  lg.startWorker();
+}
+
+
+bool hvLogger::attachThread() {
+  hvLogger& lg = instance();
+  if (lg.threadRing() == nullptr) {
+    return false;
+  }
+  lg.startWorker();
+  return true;
+}
+
+
+void hvLogger::startWorker() {
+  //Lazy start of the background thread
+  if (!running.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!running.load(std::memory_order_relaxed)) {
+      running = true;
+      worker = std::thread(&hvLogger::workerLoop, this);
+    }
+  }
+}
+
+
+void hvLogger::setOutput(FILE* fp) {
+  hvLogger& lg = instance();
+  std::lock_guard<std::mutex> lock(lg.mtx);
+  lg.out = fp;
+}
+
+
+void hvLogger::stop() {
+  hvLogger& lg = instance();
+  std::thread th;
+  {
+    std::lock_guard<std::mutex> lock(lg.mtx);
+    lg.running = false;
+    th = std::move(lg.worker);
+  }
+  if (th.joinable()) {
+    th.join();
+  }
+}
+
+
+uint64_t hvLogger::getDropped() {
+  return instance().dropped.load(std::memory_order_relaxed);
+}
+
+
+void hvLogger::drain() {
+  std::lock_guard<std::mutex> lock(mtx);
+  bool written = false;
+
+  for (std::unique_ptr<ringT>& ring : rings) {
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint32_t head = ring->head.load(std::memory_order_acquire);
+    for (; tail != head; tail++) {
+      const recordT& rec = ring->rec[tail & (ringSize - 1)];
+      fprintf(out, "[%llu.%09llu] t%u %s 0x%02x %s failed: %s (%d); 0x%04x 0x%04x\n",
+              static_cast<unsigned long long>(rec.tNs / 1000000000ULL),
+              static_cast<unsigned long long>(rec.tNs % 1000000000ULL),
+              rec.ring,
+              (rec.dev < sizeof(devNames)/sizeof(devNames[0])) ? devNames[rec.dev] : "?",
+              rec.addr,
+              (rec.op < sizeof(opNames)/sizeof(opNames[0])) ? opNames[rec.op] : "?",
+              (rec.err != 0) ? strerror(rec.err) : "short transfer",
+              rec.err, rec.val0, rec.val1);
+      written = true;
+    }
+    ring->tail.store(tail, std::memory_order_release);
+  }
+
+  uint64_t nDropped = dropped.load(std::memory_order_relaxed);
+  if (nDropped != droppedReported) {
+    fprintf(out, "hvLogger: %llu records dropped\n",
+            static_cast<unsigned long long>(nDropped - droppedReported));
+    droppedReported = nDropped;
+    written = true;
+  }
+
+  if (written) {
+    fflush(out);
+  }
+}
+
+
+void hvLogger::workerLoop() {
+  while (running.load(std::memory_order_acquire)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(drainPeriodMs));
+    drain();
+  }
+  drain();
+}
@@ -0,0 +1,173 @@
+/*!
+  @file Logger.h
+  @brief Asynchronous lock-free binary logger for the I2C paths
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+  @brief Asynchronous lock-free binary logger for the I2C paths
+  @details  Producers only fill a fixed-size record into a ring buffer owned
+            by their thread (single producer, single consumer, no lock and
+            no allocation after the first record of the thread). A
+            background thread drains all the rings, formats the records and
+            writes them out, so a failing bus costs no console I/O on the
+            transaction path.
+
+            If a ring is full the record is dropped and counted; the count is
+            reported by the background thread.
+
+            The background thread starts with the first record and is
+            stopped, after draining, at process exit or with hvLogger::stop().
+*/
+class hvLogger {
+  public:
+    /*!
+      Device of a record
+    */
+    enum devT : uint8_t {
+      devDac   = 0,
+      devAdc   = 1,
+      devBoard = 2,
+      devBus   = 3
+    };
+
+    /*!
+      Operation of a record
+    */
+    enum opT : uint8_t {
+      opWriteWord    = 0,
+      opWriteCommand = 1,
+      opSetPointer   = 2,
+      opReadConv     = 3,
+      opApplyBias    = 4,
+      opConfigure    = 5,
+      opRecover      = 6,
+      opSaveState    = 7
+    };
+
+    /*!
+      Log record
+    */
+    struct recordT {
+      uint64_t tNs;  //!< CLOCK_REALTIME timestamp, in ns
+      uint32_t val0; //!< First value (e.g. command, register)
+      uint32_t val1; //!< Second value (e.g. data)
+      int32_t err;   //!< errno of the failure; 0 if not set
+      uint8_t dev;   //!< Device, see devT
+      uint8_t addr;  //!< I2C address of the device
+      uint8_t op;    //!< Operation, see opT
+      uint8_t ring;  //!< Producer ring (one per thread)
+    };
+
+    /*!
+      Log a failure; never blocks
+      @param[in] dev Device
+      @param[in] addr I2C address of the device
+      @param[in] op Operation
+      @param[in] err errno of the failure; 0 if not set
+      @param[in] val0 First value (e.g. command, register)
+      @param[in] val1 Second value (e.g. data)
+    */
+    static void log(devT dev, uint8_t addr, opT op, int err,
+                    uint32_t val0 = 0, uint32_t val1 = 0);
+
+    /*!
+      Acquire the ring of the calling thread and start the background
+      thread now, so that later records of this thread never lock or
+      allocate (e.g. for real-time threads)
+      @return false if no ring is available; records will be dropped
+    */
+    static bool attachThread();
+
+    /*!
+      Select the output; stderr by default
+      @param[in] fp Output stream; not closed by the logger
+    */
+    static void setOutput(FILE* fp);
+
+    /*!
+      Drain the rings and stop the background thread; a later record
+      restarts it
+    */
+    static void stop();
+
+    /*!
+      Number of records dropped because of full rings
+      @return Dropped records
+    */
+    static uint64_t getDropped();
+
+  protected:
+    static constexpr uint32_t ringSize = 256; //!< Records per ring (power of 2)
+    static constexpr uint32_t drainPeriodMs = 10; //!< Background-thread polling period
+
+    /*!
+      Single-producer single-consumer ring of one thread
+    */
+    struct ringT {
+      recordT rec[ringSize];          //!< Records
+      std::atomic<uint32_t> head;     //!< Next record to write (producer)
+      std::atomic<uint32_t> tail;     //!< Next record to read (consumer)
+      std::atomic<bool> inUse;        //!< Owned by a live thread
+      uint8_t id;                     //!< Ring index
+    };
+
+    /*!
+      Releases the ring of a thread at thread exit
+    */
+    struct ringGuardT {
+      ringT* ring; //!< Ring of the thread
+      ~ringGuardT();
+    };
+
+    hvLogger();
+    ~hvLogger(); //!< Drains and stops at process exit
+
+    /*!
+      Logger instance
+      @return The process-wide logger
+    */
+    static hvLogger& instance();
+
+    /*!
+      Ring of the calling thread, acquired at its first record
+      @return Ring, or nullptr if none is available
+    */
+    ringT* threadRing();
+
+    /*!
+      Start the background thread, if not running
+    */
+    void startWorker();
+
+    /*!
+      Format and write the pending records of all the rings
+    */
+    void drain();
+
+    /*!
+      Background-thread loop
+    */
+    void workerLoop();
+
+    std::mutex mtx; //!< Protects rings, out and the thread start/stop
+    std::vector<std::unique_ptr<ringT>> rings; //!< All the rings, reused across threads
+    FILE* out; //!< Output stream
+    std::atomic<bool> running; //!< Background thread is running
+    std::thread worker; //!< Background thread
+    std::atomic<uint64_t> dropped; //!< Records dropped because of full rings
+    uint64_t droppedReported; //!< Dropped records already reported
+};
+
+#endif /*LOGGER_H_*/
@@ -6,18 +6,61 @@
 
 #include "NewHV.h"
 
+#include <errno.h>
 
-NewHVIntf::NewHVIntf(int i2cFile, uint32_t autoReadIn, uint8_t dacAddr, uint8_t adcAddr) {
-  i2cFile = i2cFile;
+
+NewHVIntf::NewHVIntf(int i2cFile, uint32_t autoReadIn, uint8_t dacAddr, uint8_t adcAddr,
+                     startModeT mode, const std::string& stateFileIn) {
+  this->i2cFile = i2cFile;
   autoRead = autoReadIn;
   voltageV = 0.0;
   voltageDac = 0;
+  appliedDac = 0;
+  dacKnown = false;
+  shutdownMode = shutdownModeT::rampDown;
+  stateFile = stateFileIn;
+  stateTmpFile = stateFile + ".tmp";
+  saveOnApply = true;
+  stateDirty = false;
   currentA = 0.0;
   currentAdc = 0;
+  alertFlag = false;
+  lastTiming = convTiming::resultT();
 
   //Instantiate DAC and ADC
   dac = new ltc1669(i2cFile, dacAddr);
   adc = new adc101(i2cFile, adcAddr);
+
+  bool blank = true;
+  if (mode == startModeT::warm) {
+    bool adcAdopted = adc->adoptState();
+    if (!adcAdopted) {
+      printf("Failed to read back ADC %02x: it will be reconfigured\n", adcAddr);
+    }
+
+    //The LTC1669 cannot be read back: rely on the persisted code, unless
+    //the board was power-cycled (DAC reset to zero scale). The code is not
+    //taken as in effect (another process may have changed it): the next
+    //applyBias() rewrites it, which is glitch-free for the same code.
+    uint16_t code;
+    bool powerCycled = adcAdopted && adc->atPowerOnDefaults();
+    blank = !adcAdopted || powerCycled;
+    if (powerCycled) {
+      printf("Board %02x was power-cycled: bias is 0 V\n", dacAddr);
+    } else if (loadState(code)) {
+      voltageDac = code;
+      voltageV = voltageD2V();
+    } else {
+      printf("No valid state for DAC %02x: bias will be rewritten\n", dacAddr);
+    }
+  }
+  //Configure a blank ADC once: its configuration register leaves the
+  //power-on value, so a warm start can tell a power cycle from a restart
+  if (blank && !adc->stopAutoConv()) {
+    printf("Failed to configure ADC %02x: a warm start will find it blank\n", adcAddr);
+  }
+  //The ADC may already be converting on its own
+  resetTiming();
 }
 
 
@@ -28,9 +71,12 @@ NewHVIntf::~NewHVIntf() {
   currentA = 0.0;
   currentAdc = 0;
   
-  //Turn off output voltage
-  setBias(0.0);
-  applyBias();
+  //Turn off output voltage, unless it has to survive a restart
+  if (shutdownMode == shutdownModeT::rampDown) {
+    setBias(0.0);
+    applyBias();
+  }
+  flushState();
 
   //Delete DAC and ADC istances
   if(dac!=nullptr)
@@ -67,10 +113,99 @@ void NewHVIntf::setBias(float vSet) {
 
 
 bool NewHVIntf::applyBias() {
-  if(dac->writeWord(0x04, voltageDac)) {
-    printf("Failed to apply bias to DAC %02x", dac->getAddress());
+  if (dacKnown && appliedDac == voltageDac) {
+    return true;
+  }
+  if(!dac->writeWord(dacCommand, voltageDac)) {
+    //ltcDac::writeWord() logs the failure
+    dacKnown = false;
     return false;
   }
+  appliedDac = voltageDac;
+  dacKnown = true;
+  if (saveOnApply) {
+    saveState();
+  } else {
+    stateDirty = true;
+  }
+  return true;
+}
+
+
+bool NewHVIntf::reapplyState() {
+  bool bSuccess = adc->reapplyState();
+  resetTiming();
+  //Rewrite the DAC only if a code was in effect
+  if (dacKnown) {
+    dacKnown = false;
+    uint16_t requested = voltageDac;
+    voltageDac = appliedDac;
+    bSuccess = applyBias() && bSuccess;
+    voltageDac = requested;
+  }
+  return bSuccess;
+}
+
+
+void NewHVIntf::setShutdownMode(shutdownModeT mode) {
+  shutdownMode = mode;
+}
+
+
+void NewHVIntf::setSaveOnApply(bool onApply) {
+  saveOnApply = onApply;
+}
+
+
+bool NewHVIntf::flushState() {
+  if (!stateDirty) {
+    return true;
+  }
+  return saveState();
+}
+
+
+float NewHVIntf::getBias() {
+  return voltageV;
+}
+
+
+bool NewHVIntf::loadState(uint16_t &code) {
+  if (stateFile.empty()) {
+    return false;
+  }
+  FILE* fp = fopen(stateFile.c_str(), "r");
+  if (fp == nullptr) {
+    return false;
+  }
+  unsigned addrIn = 0, codeIn = 0;
+  bool bSuccess = (fscanf(fp, "%x %u", &addrIn, &codeIn) == 2)
+                  && (addrIn == dac->getAddress()) && (codeIn <= 0x03FF);
+  fclose(fp);
+  code = codeIn;
+  return bSuccess;
+}
+
+
+bool NewHVIntf::saveState() {
+  if (stateFile.empty()) {
+    return true;
+  }
+  //Write aside and rename, so that a crash never leaves a torn file
+  FILE* fp = fopen(stateTmpFile.c_str(), "w");
+  if (fp == nullptr) {
+    hvLogger::log(hvLogger::devBoard, dac->getAddress(), hvLogger::opSaveState,
+                  errno, appliedDac, 0);
+    return false;
+  }
+  bool bSuccess = (fprintf(fp, "%02x %u\n", dac->getAddress(), appliedDac) > 0);
+  bSuccess = (fclose(fp) == 0) && bSuccess;
+  if (!bSuccess || rename(stateTmpFile.c_str(), stateFile.c_str()) != 0) {
+    hvLogger::log(hvLogger::devBoard, dac->getAddress(), hvLogger::opSaveState,
+                  errno, appliedDac, 1);
+    return false;
+  }
+  stateDirty = false;
   return true;
 }
 
@@ -81,6 +216,9 @@ bool NewHVIntf::readAdcSingle(float &value, bool &alert) {
   //Read from ADC and convert in uA
   bSuccess = adc->getConv(currentAdc, alertFlag);
   currentA = currentAdc2I(currentAdc);
+  if (bSuccess) {
+    updateTiming(convTiming::monotonicNs());
+  }
 
   //Output
   value = currentA;
@@ -100,14 +238,67 @@ void NewHVIntf::readAdc(float &value, bool &alert) {
 }
 
 
+unsigned NewHVIntf::readAdcBatch(int i2cFile, NewHVIntf* const* boards,
+                                 bool* ok, unsigned n) {
+  adc101* adcs[adc101::batchMax];
+  unsigned nOk = 0;
+
+  for (unsigned first = 0; first < n; first += adc101::batchMax) {
+    unsigned nChunk = (n - first < adc101::batchMax) ? (n - first) : adc101::batchMax;
+    for (unsigned ii = 0; ii < nChunk; ii++) {
+      adcs[ii] = boards[first+ii]->adc;
+    }
+    int64_t t0 = convTiming::monotonicNs();
+    nOk += adc101::batchConversion(i2cFile, adcs, &ok[first], nChunk);
+    int64_t t1 = convTiming::monotonicNs();
+    for (unsigned ii = 0; ii < nChunk; ii++) {
+      NewHVIntf* nhv = boards[first+ii];
+      if (ok[first+ii]) {
+        nhv->adc->updateConv(nhv->currentAdc, nhv->alertFlag);
+        nhv->currentA = nhv->currentAdc2I(nhv->currentAdc);
+        //The messages of the ioctl are sent in order: read time of the ADC
+        //interpolated in the middle of its slot
+        nhv->updateTiming(t0 + (t1 - t0) * (2 * ii + 1) / (2 * nChunk));
+      }
+    }
+  }
+
+  return nOk;
+}
+
+
+bool NewHVIntf::setAutoConv(adc101::cycleTimeT timer) {
+  bool bSuccess = (timer == adc101::cycleTimeT::off) ? adc->stopAutoConv()
+                                                     : adc->startAutoConv(timer);
+  resetTiming();
+  return bSuccess;
+}
+
+
+convTiming::resultT NewHVIntf::getTiming() {
+  return lastTiming;
+}
+
+
+void NewHVIntf::resetTiming() {
+  timing.reset(adc101::cyclePeriodNs(adc->getCycleTime()));
+}
+
+
+void NewHVIntf::updateTiming(int64_t tNs) {
+  uint16_t word = currentAdc | (alertFlag ? 0x8000 : 0);
+  lastTiming = timing.update(tNs, word);
+}
+
+
 void NewHVIntf::readAdcLoop() {
   //Map timer to adc101::cycleTimeT enum
   //autoRead; //Input timer
   //adc::cycleTimeT timer; //output timer
 
   
-  //Start ADC auto-conversion
-  adc->startAutoConv(adc->cycleTimeT::kspsP4);
+  //Start ADC auto-conversion; failures are logged by adc101
+  setAutoConv(adc101::cycleTimeT::kspsP4);
 
   //!@todo Automatically read ADC
 
@@ -9,17 +9,81 @@
 
 #include <unistd.h>
 #include <stdint.h>
+#include <string>
 
 #include "../LTC1669/LTC1669.h"
 #include "../ADC101CS021/ADC101CS021.h"
+#include "../ConvTiming/ConvTiming.h"
 
 /*!
   @brief I2C-interface to the NewHV board
 */
 class NewHVIntf {
   public:
-    NewHVIntf(int i2cFile, uint32_t autoReadIn, uint8_t dacAddr, uint8_t adcAddr); //!< Constructor
-    virtual ~NewHVIntf(); //!< Destructor
+    /*!
+      Startup mode
+      | Mode | Behaviour |
+      |:----:|:---------:|
+      | cold | Blank device: the ADC is configured (automatic conversion off), the other registers are written when first used |
+      | warm | Adopt the device state: ADC registers are read back and ADC writes already in effect are skipped; the last applied DAC code is restored from the state file (0 if the board was power-cycled) and rewritten by the next applyBias() |
+    */
+    enum startModeT : uint8_t {
+      cold = 0,
+      warm = 1
+    };
+
+    /*!
+      Shutdown mode
+      | Mode | Behaviour |
+      |:----:|:---------:|
+      | rampDown | Drive the bias to 0 V in the destructor |
+      | keepHV   | Leave the bias as it is, for a later warm start |
+    */
+    enum shutdownModeT : uint8_t {
+      rampDown = 0,
+      keepHV   = 1
+    };
+
+    /*!
+      Constructor
+      @param[in] i2cFile I2C device
+      @param[in] autoReadIn Auto-read interval, in us; 0: off
+      @param[in] dacAddr I2C address of the DAC
+      @param[in] adcAddr I2C address of the ADC
+      @param[in] mode Startup mode; a warm start falls back to cold for the
+                 parts of the state that cannot be recovered
+      @param[in] stateFileIn File persisting the last applied DAC code;
+                 empty: no persistence
+    */
+    NewHVIntf(int i2cFile, uint32_t autoReadIn, uint8_t dacAddr, uint8_t adcAddr,
+              startModeT mode = startModeT::cold, const std::string& stateFileIn = "");
+    virtual ~NewHVIntf(); //!< Destructor; see NewHVIntf::setShutdownMode()
+
+    /*!
+      Select what the destructor does with the bias
+      @param[in] mode Shutdown mode
+    */
+    void setShutdownMode(shutdownModeT mode);
+
+    /*!
+      Select when the state file is written: at every applied bias
+      (default), or only by NewHVIntf::flushState() and the destructor, so
+      that applyBias() neither allocates nor touches the filesystem
+      @param[in] onApply true: write at every applied bias
+    */
+    void setSaveOnApply(bool onApply);
+
+    /*!
+      Write the state file if an applied bias was not persisted yet
+      @return false for error
+    */
+    bool flushState();
+
+    /*!
+      Get Vbias in volts (e.g. as adopted by a warm start)
+      @return Set voltage, in volts
+    */
+    float getBias();
     
     /*!
       Set Vbias in volts and DAC units
@@ -28,11 +92,19 @@ class NewHVIntf {
     void setBias(float vSet);
 
     /*!
-      Apply Vbias in output
+      Apply Vbias in output; skipped if the DAC already holds the code.
+      The applied code is persisted in the state file, if any.
       @return False for error
     */
     bool applyBias();
 
+    /*!
+      Write again the DAC code and the ADC configuration in effect before
+      a bus recovery (see i2cPolicy::addReapply())
+      @return False for error
+    */
+    bool reapplyState();
+
     /*!
       Calls adc101::getConv() to set the pointer to the conversion register and
       reads the conversion result. Slower than NewHVIntf::readAdc() because of
@@ -58,6 +130,36 @@ class NewHVIntf {
     */
     void readAdcLoop();
 
+    /*!
+      Start or stop the ADC automatic conversion and restart the timing
+      model of the readings (see NewHVIntf::getTiming())
+      @param[in] timer Automatic conversion rate; adc101::cycleTimeT::off to
+                 go back to Normal Conversion mode
+      @return false for error
+    */
+    bool setAutoConv(adc101::cycleTimeT timer);
+
+    /*!
+      Timing of the last reading of NewHVIntf::readAdcBatch() or
+      NewHVIntf::readAdcSingle(): in Automatic Conversion mode, the
+      drift-corrected conversion time and the duplicate/skipped flags
+      @return Timing; times in CLOCK_MONOTONIC ns
+    */
+    convTiming::resultT getTiming();
+
+    /*!
+      Read the current monitor of many boards on the same bus with the
+      batched adc101::batchConversion(); the readings are then available
+      with NewHVIntf::readAdc()
+      @param[in] i2cFile I2C bus
+      @param[in] boards Board interfaces
+      @param[out] ok Per-board outcome; false for error
+      @param[in] n Number of boards
+      @return Number of boards read successfully
+    */
+    static unsigned readAdcBatch(int i2cFile, NewHVIntf* const* boards,
+                                 bool* ok, unsigned n);
+
   
   protected:
     int i2cFile; //!< I2C device
@@ -70,6 +172,13 @@ class NewHVIntf {
     static constexpr uint16_t  dacMin = 0; //!< DAC lowest code for meaningful output
     static constexpr uint16_t  dacMAX = 512; //!< DAC highest code for meaningful output
     static constexpr float voltConvRatio = dacMAX / biasMAX; //!< Conversion factor from DAC codes to LT3482 out voltage
+    uint16_t appliedDac; //!< DAC code in effect on the device
+    bool dacKnown; //!< NewHVIntf::appliedDac matches the device
+    shutdownModeT shutdownMode; //!< What the destructor does with the bias
+    std::string stateFile; //!< File persisting NewHVIntf::appliedDac
+    std::string stateTmpFile; //!< Temporary file of the atomic replace of stateFile
+    bool saveOnApply; //!< Persist at every applied bias
+    bool stateDirty; //!< An applied bias is not persisted yet
     
     //ADC
 
@@ -80,12 +189,29 @@ class NewHVIntf {
     static constexpr uint8_t   Vdd = 5; //!< Supply of the ADC
     static constexpr uint16_t  resolution = 1024; //!< ADC resolution (\f$ 2^{bit} \f$)
     static constexpr uint8_t   ImonFactor = 5; //!< Factor between output and monitored current 
-    static constexpr float currConvRatio = (ImonFactor/Rgain)*(Vdd/resolution)*1000000; //!< Conversion factor from ADC codes to current in uA
+    static constexpr float currConvRatio = (ImonFactor/float(Rgain))*(Vdd/float(resolution))*1000000; //!< Conversion factor from ADC codes to current in uA
+
 
+    //! DAC command byte: internal band-gap reference, operating mode, update on stop
+    static constexpr uint8_t dacCommand = ltc1669Map::cmdFields::pack(1, 0, 0);
 
     ltc1669* dac; //!< DAC interface instance
     adc101* adc;  //!< ADC interface instance
 
+    convTiming timing;           //!< Conversion grid of the ADC readings
+    convTiming::resultT lastTiming; //!< Timing of the last reading
+
+    /*!
+      Restart the timing model with the conversion rate of the device
+    */
+    void resetTiming();
+
+    /*!
+      Assign the last conversion read to the conversion grid
+      @param[in] tNs Time of the reading (CLOCK_MONOTONIC, ns)
+    */
+    void updateTiming(int64_t tNs);
+
     /*!
       Translate the voltage from volts to DAC units.
       
@@ -98,7 +224,7 @@ class NewHVIntf {
       @param[in] vIn Voltage to set in V
       @return Voltage to set in DAC codes (uint16_t)
     */
-    uint16_t voltageV2D(float vIn);
+    static uint16_t voltageV2D(float vIn);
 
     /*!
       Translate the voltage from DAC units to volts
@@ -116,7 +242,22 @@ class NewHVIntf {
       @param[in] adcVal ADC conversion in ADC units
       @return Current monitor in uA (float)
     */
-    float currentAdc2I(uint16_t adcVal);
+    static float currentAdc2I(uint16_t adcVal);
+
+    /*!
+      Load the last applied DAC code from the state file
+      @param[out] code DAC code
+      @return false if missing, unreadable or written for another DAC
+    */
+    bool loadState(uint16_t &code);
+
+    /*!
+      Persist NewHVIntf::appliedDac in the state file (atomic replace)
+      @return false for error
+    */
+    bool saveState();
+
+    friend class channelTable; //!< Shares the board constants and conversions
 
 };
 
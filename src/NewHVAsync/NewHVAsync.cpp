@@ -0,0 +1,220 @@
+/*!
+  @file NewHVAsync.cpp
+  @brief Asynchronous front end to the NewHV boards of one I2C bus
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#include "NewHVAsync.h"
+
+#include <memory>
+
+
+NewHVAsync::NewHVAsync(int i2cFileIn) : sched(i2cFileIn) {
+  i2cFile = i2cFileIn;
+  policy = nullptr;
+  readQueued = false;
+  running = true;
+}
+
+
+NewHVAsync::~NewHVAsync() {
+  stop();
+  i2cFile = 0;
+}
+
+
+unsigned NewHVAsync::addChannel(NewHVIntf* nhv) {
+  std::lock_guard<std::mutex> lock(mtx);
+  channelT chan;
+  chan.nhv = nhv;
+  chan.biasPending = false;
+  chan.biasPrio = busScheduler::control;
+  chan.biasV = 0.0;
+  channels.push_back(chan);
+  if (policy != nullptr) {
+    policy->addReapply([nhv] { return nhv->reapplyState(); });
+  }
+  return channels.size() - 1;
+}
+
+
+void NewHVAsync::setPolicy(i2cPolicy* policyIn) {
+  std::lock_guard<std::mutex> lock(mtx);
+  policy = policyIn;
+  for (channelT& chan : channels) {
+    NewHVIntf* nhv = chan.nhv;
+    policy->addReapply([nhv] { return nhv->reapplyState(); });
+  }
+}
+
+
+std::future<bool> NewHVAsync::setBias(unsigned ch, float vSet,
+                                      busScheduler::prioT prio) {
+  std::shared_ptr<std::promise<bool>> prom = std::make_shared<std::promise<bool>>();
+  std::future<bool> fut = prom->get_future();
+  setBias(ch, vSet, [prom](bool ok) { prom->set_value(ok); }, prio);
+  return fut;
+}
+
+
+void NewHVAsync::setBias(unsigned ch, float vSet, biasCbT cb,
+                         busScheduler::prioT prio) {
+  if (prio != busScheduler::safety) {
+    prio = busScheduler::control;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (running && ch < channels.size()) {
+      channelT& chan = channels[ch];
+      //Latest wins: overwrite the value of a still-pending write; queue a
+      //new transaction only if none is pending or this one is more urgent
+      bool queued = true;
+      if (!chan.biasPending || prio < chan.biasPrio) {
+        queued = sched.submit(prio, [this, ch] { biasJob(ch, true); },
+                              [this, ch] { biasJob(ch, false); });
+        if (queued) {
+          chan.biasPrio = prio;
+        }
+      }
+      if (queued) {
+        chan.biasPending = true;
+        chan.biasV = vSet;
+        chan.biasWaiters.push_back(cb);
+        return;
+      }
+    }
+  }
+  cb(false);
+}
+
+
+std::future<NewHVAsync::readingT> NewHVAsync::readCurrent(unsigned ch) {
+  std::shared_ptr<std::promise<readingT>> prom = std::make_shared<std::promise<readingT>>();
+  std::future<readingT> fut = prom->get_future();
+  readCurrent(ch, [prom](const readingT& rd) { prom->set_value(rd); });
+  return fut;
+}
+
+
+void NewHVAsync::readCurrent(unsigned ch, readCbT cb) {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (running && ch < channels.size()) {
+      //Joins the read cycle already queued, if any
+      bool queued = true;
+      if (!readQueued) {
+        queued = sched.submit(busScheduler::monitoring, [this] { readJob(true); },
+                              [this] { readJob(false); });
+        readQueued = queued;
+      }
+      if (queued) {
+        channels[ch].readWaiters.push_back(cb);
+        return;
+      }
+    }
+  }
+  readingT rd = {false, 0.0, false};
+  cb(rd);
+}
+
+
+void NewHVAsync::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    running = false;
+  }
+  sched.stop();
+}
+
+
+busScheduler& NewHVAsync::getScheduler() {
+  return sched;
+}
+
+
+void NewHVAsync::biasJob(unsigned ch, bool locked) {
+  NewHVIntf* nhv;
+  float v;
+  std::vector<biasCbT> waiters;
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    channelT& chan = channels[ch];
+    if (!chan.biasPending) {
+      return; //Already served by a more urgent transaction
+    }
+    nhv = chan.nhv;
+    v = chan.biasV;
+    waiters.swap(chan.biasWaiters);
+    chan.biasPending = false;
+  }
+
+  //Without the bus lock the write fails and the board is left as it is
+  bool ok = false;
+  if (locked) {
+    nhv->setBias(v);
+    if (policy != nullptr) {
+      ok = (policy->run([nhv] { return nhv->applyBias(); }) == i2cPolicy::ok);
+    } else {
+      ok = nhv->applyBias();
+    }
+  }
+  for (biasCbT& cb : waiters) {
+    cb(ok);
+  }
+}
+
+
+void NewHVAsync::readJob(bool locked) {
+  struct readT {
+    NewHVIntf* nhv;
+    std::vector<readCbT> waiters;
+  };
+  std::vector<readT> reads;
+  {
+    //Snapshot of the cycle; new readers queue up for the next one
+    std::lock_guard<std::mutex> lock(mtx);
+    for (channelT& chan : channels) {
+      if (!chan.readWaiters.empty()) {
+        readT rd;
+        rd.nhv = chan.nhv;
+        rd.waiters.swap(chan.readWaiters);
+        reads.push_back(std::move(rd));
+      }
+    }
+    readQueued = false;
+  }
+
+  if (reads.empty()) {
+    return;
+  }
+
+  //All the ADCs of the cycle in one batched transfer
+  std::vector<NewHVIntf*> boards(reads.size());
+  std::unique_ptr<bool[]> ok(new bool[reads.size()]);
+  for (unsigned ii = 0; ii < reads.size(); ii++) {
+    boards[ii] = reads[ii].nhv;
+    ok[ii] = false;
+  }
+  //Without the bus lock the whole cycle fails
+  if (locked) {
+    if (policy != nullptr) {
+      //Retry/recover only if the whole bus is silent; dead boards fail alone
+      policy->run([&] {
+        return NewHVIntf::readAdcBatch(i2cFile, boards.data(), ok.get(), boards.size()) > 0;
+      });
+    } else {
+      NewHVIntf::readAdcBatch(i2cFile, boards.data(), ok.get(), boards.size());
+    }
+  }
+
+  for (unsigned ii = 0; ii < reads.size(); ii++) {
+    readingT val = {false, 0.0, false};
+    if (ok[ii]) {
+      reads[ii].nhv->readAdc(val.currentUa, val.alert);
+      val.ok = true;
+    }
+    for (readCbT& cb : reads[ii].waiters) {
+      cb(val);
+    }
+  }
+}
@@ -0,0 +1,164 @@
+/*!
+  @file NewHVAsync.h
+  @brief Asynchronous front end to the NewHV boards of one I2C bus
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#ifndef NHVASYNC_H_
+#define NHVASYNC_H_
+
+#include <stdint.h>
+#include <vector>
+#include <functional>
+#include <future>
+#include <mutex>
+
+#include "../NewHV/NewHV.h"
+#include "../BusScheduler/BusScheduler.h"
+#include "../I2CPolicy/I2CPolicy.h"
+
+/*!
+  @brief Asynchronous front end to the NewHV boards of one I2C bus
+  @details  One instance per I2C bus: all the NewHVIntf channels registered
+            here share the same i2cFile and are only accessed through the
+            busScheduler of the bus, so callers never block on the bus.
+
+            Requests are coalesced per channel:
+            - a setBias() still pending when a newer one arrives is
+              superseded; only the newest value reaches the DAC and all the
+              waiters get the outcome of that single write;
+            - all the readCurrent() queued on the same channel within one
+              read cycle share a single ADC transaction, and all the ADCs
+              of a read cycle are read with one I2C_RDWR ioctl per
+              adc101::batchMax devices.
+
+            Bias writes are scheduled in the control class, or in the safety
+            class when requested (e.g. emergency ramp-down); a pending write
+            is re-queued at the higher class if a safety request supersedes
+            it. Read cycles are scheduled in the monitoring class.
+            Completion callbacks run on the scheduler thread and must not
+            block.
+*/
+class NewHVAsync {
+  public:
+    /*!
+      Result of a current reading
+    */
+    struct readingT {
+      bool ok;          //!< false for error
+      float currentUa;  //!< Current monitor (in uA)
+      bool alert;       //!< Alert flag of the ADC
+    };
+
+    typedef std::function<void(bool)> biasCbT; //!< Completion callback of setBias()
+    typedef std::function<void(const readingT&)> readCbT; //!< Completion callback of readCurrent()
+
+    /*!
+      Constructor; starts the bus scheduler
+      @param[in] i2cFileIn I2C bus shared by all the channels
+    */
+    explicit NewHVAsync(int i2cFileIn);
+    virtual ~NewHVAsync(); //!< Destructor; serves the pending requests and stops the scheduler
+
+    /*!
+      Register a board on this bus. The instance is not owned and must
+      outlive this object.
+      @param[in] nhv Board interface
+      @return Channel index to be used in the requests
+    */
+    unsigned addChannel(NewHVIntf* nhv);
+
+    /*!
+      Queue a bias update
+      @param[in] ch Channel index
+      @param[in] vSet Voltage to set, in volts
+      @param[in] prio busScheduler::control or busScheduler::safety
+      @return Future set to false for error
+    */
+    std::future<bool> setBias(unsigned ch, float vSet,
+                              busScheduler::prioT prio = busScheduler::control);
+
+    /*!
+      Queue a bias update
+      @param[in] ch Channel index
+      @param[in] vSet Voltage to set, in volts
+      @param[in] cb Callback invoked with false for error
+      @param[in] prio busScheduler::control or busScheduler::safety
+    */
+    void setBias(unsigned ch, float vSet, biasCbT cb,
+                 busScheduler::prioT prio = busScheduler::control);
+
+    /*!
+      Queue a current reading
+      @param[in] ch Channel index
+      @return Future with the reading
+    */
+    std::future<readingT> readCurrent(unsigned ch);
+
+    /*!
+      Queue a current reading
+      @param[in] ch Channel index
+      @param[in] cb Callback invoked with the reading
+    */
+    void readCurrent(unsigned ch, readCbT cb);
+
+    /*!
+      Serve the pending requests and stop the scheduler; further requests
+      fail immediately
+    */
+    void stop();
+
+    /*!
+      Run all the transactions through a retry and recovery policy; the
+      state of every channel is registered for re-application after a
+      recovery. Call it before the first request.
+      @param[in] policyIn Policy of this bus; not owned, must outlive this object
+    */
+    void setPolicy(i2cPolicy* policyIn);
+
+    /*!
+      Scheduler of the bus, to share it with other transactions (e.g.
+      housekeeping)
+      @return Bus scheduler
+    */
+    busScheduler& getScheduler();
+
+  protected:
+    /*!
+      Per-channel coalescing state
+    */
+    struct channelT {
+      NewHVIntf* nhv;                   //!< Board interface
+      bool biasPending;                 //!< A bias write is queued
+      busScheduler::prioT biasPrio;     //!< Class of the queued bias write
+      float biasV;                      //!< Newest requested bias, in volts
+      std::vector<biasCbT> biasWaiters; //!< Waiters of the queued bias write
+      std::vector<readCbT> readWaiters; //!< Waiters of the queued reading
+    };
+
+    int i2cFile; //!< I2C bus
+    std::vector<channelT> channels; //!< Registered channels
+    i2cPolicy* policy; //!< Retry and recovery policy; nullptr: single attempt
+
+    std::mutex mtx; //!< Protects channels, readQueued and running
+    bool readQueued; //!< A read cycle is queued
+    bool running; //!< Requests are accepted
+    busScheduler sched; //!< Scheduler of the bus
+
+    /*!
+      Bias-write transaction: applies the newest bias of a channel, if
+      still pending
+      @param[in] ch Channel index
+      @param[in] locked The bus lock is held; otherwise the waiters fail
+    */
+    void biasJob(unsigned ch, bool locked);
+
+    /*!
+      Read-cycle transaction: one batched ADC readout of all the channels
+      with readers waiting
+      @param[in] locked The bus lock is held; otherwise the waiters fail
+    */
+    void readJob(bool locked);
+};
+
+#endif /*NHVASYNC_H_*/
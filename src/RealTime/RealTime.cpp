@@ -0,0 +1,183 @@
+/*!
+  @file RealTime.cpp
+  @brief Opt-in real-time mode of the acquisition and control threads
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#include "RealTime.h"
+
+#include <alloca.h>
+#include <errno.h>
+#include <malloc.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../Logger/Logger.h"
+
+
+/*!
+  Grow the stack by len bytes, touching every page
+  @param[in] len Bytes to touch
+*/
+static void prefaultStack(size_t len) {
+  //Kept on the stack by the volatile accesses; released at return
+  volatile uint8_t* stack = static_cast<volatile uint8_t*>(alloca(len));
+  long page = sysconf(_SC_PAGESIZE);
+  for (size_t ii = 0; ii < len; ii += page) {
+    stack[ii] = 0;
+  }
+}
+
+
+rtMode::cfgT rtMode::defaultCfg() {
+  cfgT cfg;
+  cfg.enable = false;
+  cfg.cpu = -1;
+  cfg.priority = 50;
+  cfg.stackBytes = 64 * 1024;
+  return cfg;
+}
+
+
+bool rtMode::apply(const cfgT& cfg) {
+  if (!cfg.enable) {
+    return true;
+  }
+  bool bSuccess = true;
+
+  if (cfg.cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cfg.cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+      fprintf(stderr, "Failed to pin the thread to CPU %d: %s\n", cfg.cpu, strerror(err));
+      errno = err;
+      bSuccess = false;
+    }
+  }
+
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = cfg.priority;
+  int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (err != 0) {
+    fprintf(stderr, "Failed to set SCHED_FIFO priority %d: %s\n", cfg.priority, strerror(err));
+    errno = err;
+    bSuccess = false;
+  }
+
+  prefaultStack(cfg.stackBytes);
+
+  //Acquire the log ring now: the first record must not allocate
+  hvLogger::attachThread();
+
+  return bSuccess;
+}
+
+
+bool rtMode::lockMemory() {
+  //Freed memory stays in the heap instead of going back to the system
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+    perror("Failed to lock the process memory");
+    return false;
+  }
+  return true;
+}
+
+
+void rtMode::prefault(void* buf, size_t len) {
+  volatile uint8_t* bytes = static_cast<volatile uint8_t*>(buf);
+  long page = sysconf(_SC_PAGESIZE);
+  for (size_t ii = 0; ii < len; ii += page) {
+    bytes[ii] = bytes[ii];
+  }
+  if (len > 0) {
+    bytes[len-1] = bytes[len-1];
+  }
+}
+
+
+void rtMode::addUs(struct timespec& t, uint32_t us) {
+  t.tv_nsec += static_cast<long>(us % 1000000) * 1000;
+  t.tv_sec += us / 1000000 + t.tv_nsec / 1000000000;
+  t.tv_nsec %= 1000000000;
+}
+
+
+jitterMeter::jitterMeter(uint32_t periodUs) {
+  reset(periodUs);
+}
+
+
+void jitterMeter::reset(uint32_t periodUs) {
+  periodNs = static_cast<int64_t>(periodUs) * 1000;
+  lastNs = -1;
+  memset(&stats, 0, sizeof(stats));
+  sumErr = 0.0;
+  sumErr2 = 0.0;
+}
+
+
+void jitterMeter::sample(const struct timespec& deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  sample(deadline, now);
+}
+
+
+void jitterMeter::sample(const struct timespec& deadline, const struct timespec& now) {
+  int64_t nowNs = static_cast<int64_t>(now.tv_sec) * 1000000000LL + now.tv_nsec;
+  int64_t deadlineNs = static_cast<int64_t>(deadline.tv_sec) * 1000000000LL + deadline.tv_nsec;
+
+  int64_t lat = nowNs - deadlineNs;
+  if (lat > stats.maxLatNs) {
+    stats.maxLatNs = lat;
+  }
+  if (lat > periodNs) {
+    stats.overruns++;
+  }
+
+  if (lastNs >= 0) {
+    int64_t err = (nowNs - lastNs) - periodNs;
+    if (stats.periods == 0 || err < stats.minErrNs) {
+      stats.minErrNs = err;
+    }
+    if (stats.periods == 0 || err > stats.maxErrNs) {
+      stats.maxErrNs = err;
+    }
+    sumErr += err;
+    sumErr2 += static_cast<double>(err) * err;
+    stats.periods++;
+  }
+  lastNs = nowNs;
+}
+
+
+jitterMeter::statsT jitterMeter::getStats() {
+  statsT out = stats;
+  if (stats.periods > 0) {
+    out.meanErrNs = static_cast<int64_t>(sumErr / stats.periods);
+    out.rmsErrNs = static_cast<int64_t>(sqrt(sumErr2 / stats.periods));
+  }
+  return out;
+}
+
+
+void jitterMeter::print(const char* label) {
+  statsT st = getStats();
+  printf("%s: %llu periods of %.1f us; period error min %.1f, max %.1f, "
+         "mean %.1f, rms %.1f us; max latency %.1f us; %llu overruns\n",
+         label, (unsigned long long)st.periods, periodNs / 1000.0,
+         st.minErrNs / 1000.0, st.maxErrNs / 1000.0, st.meanErrNs / 1000.0,
+         st.rmsErrNs / 1000.0, st.maxLatNs / 1000.0,
+         (unsigned long long)st.overruns);
+}
@@ -0,0 +1,155 @@
+/*!
+  @file RealTime.h
+  @brief Opt-in real-time mode of the acquisition and control threads
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#ifndef REALTIME_H_
+#define REALTIME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*!
+  @brief Opt-in real-time mode of the acquisition and control threads
+  @details  On the DE10 HPS the two ARM cores are shared with the DAQ
+            software, so the sampling jitter depends on its load. A thread
+            in real-time mode:
+            - is pinned to one CPU (e.g. the core not used by the DAQ);
+            - runs with SCHED_FIFO priority, above every SCHED_OTHER task;
+            - has its stack pre-faulted, so that it never page-faults on it.
+
+            The process memory is locked once with rtMode::lockMemory():
+            every page mapped now or later stays resident, and the heap is
+            never trimmed nor served by fresh mmap()s, so the memory freed
+            after startup is reused without page faults.
+
+            The real-time loops (EFORO monitoring, libnewhv streaming) only
+            use buffers allocated and pre-faulted before their first period
+            and do not allocate afterwards. Setting SCHED_FIFO requires
+            CAP_SYS_NICE (or root); a failure is reported and the thread
+            keeps running in normal mode.
+*/
+class rtMode {
+  public:
+    /*!
+      Real-time configuration of a thread
+    */
+    struct cfgT {
+      bool enable;       //!< Real-time mode on; false: leave the thread as it is
+      int cpu;           //!< CPU to pin the thread to; -1: any
+      int priority;      //!< SCHED_FIFO priority, 1 (lowest) to 99
+      size_t stackBytes; //!< Stack pre-faulted by apply()
+    };
+
+    /*!
+      Default configuration: disabled; if enabled, any CPU, priority 50
+      and 64 kB of stack
+      @return Configuration
+    */
+    static cfgT defaultCfg();
+
+    /*!
+      Apply a configuration to the calling thread
+      @param[in] cfg Configuration; nothing is done if cfgT::enable is false
+      @return false if a setting could not be applied (see errno)
+    */
+    static bool apply(const cfgT& cfg);
+
+    /*!
+      Lock the current and future memory of the process and keep the heap
+      from returning memory to the system (process-wide)
+      @return false for error (see errno)
+    */
+    static bool lockMemory();
+
+    /*!
+      Touch every page of a buffer, so that later accesses do not fault
+      @param[in] buf Buffer; its content is preserved
+      @param[in] len Buffer size, in bytes
+    */
+    static void prefault(void* buf, size_t len);
+
+    /*!
+      Advance an absolute deadline
+      @param[in,out] t Deadline
+      @param[in] us Period, in us
+    */
+    static void addUs(struct timespec& t, uint32_t us);
+};
+
+
+/*!
+  @brief Wake-up jitter of a periodic loop
+  @details  The loop calls jitterMeter::sample() right after waking up at
+            each absolute deadline. The meter keeps, without allocating:
+            - the period error: measured period (between two wake-ups)
+              minus the nominal one;
+            - the latency: wake-up time minus the deadline;
+            - the overruns: wake-ups later than one whole period.
+            Not thread-safe: read the statistics from the loop thread or
+            under the lock that the loop holds while sampling.
+*/
+class jitterMeter {
+  public:
+    /*!
+      Jitter statistics; all times in ns
+    */
+    struct statsT {
+      uint64_t periods;  //!< Measured periods
+      int64_t minErrNs;  //!< Smallest period error
+      int64_t maxErrNs;  //!< Largest period error
+      int64_t meanErrNs; //!< Mean period error
+      int64_t rmsErrNs;  //!< RMS period error
+      int64_t maxLatNs;  //!< Largest wake-up latency
+      uint64_t overruns; //!< Wake-ups later than one period
+    };
+
+    /*!
+      Constructor
+      @param[in] periodUs Nominal period, in us
+    */
+    explicit jitterMeter(uint32_t periodUs = 0);
+
+    /*!
+      Clear the statistics
+      @param[in] periodUs Nominal period, in us
+    */
+    void reset(uint32_t periodUs);
+
+    /*!
+      Record a wake-up
+      @param[in] deadline Deadline of this wake-up (CLOCK_MONOTONIC)
+    */
+    void sample(const struct timespec& deadline);
+
+    /*!
+      Record a wake-up whose time was taken earlier (e.g. before waiting
+      for the lock that protects the meter)
+      @param[in] deadline Deadline of this wake-up (CLOCK_MONOTONIC)
+      @param[in] wake Wake-up time (CLOCK_MONOTONIC)
+    */
+    void sample(const struct timespec& deadline, const struct timespec& wake);
+
+    /*!
+      Get the statistics
+      @return Statistics
+    */
+    statsT getStats();
+
+    /*!
+      Print the statistics
+      @param[in] label Name of the loop
+    */
+    void print(const char* label);
+
+  protected:
+    int64_t periodNs; //!< Nominal period
+    int64_t lastNs;   //!< Last wake-up; -1: none
+    statsT stats;     //!< Statistics, meanErrNs and rmsErrNs excluded
+    double sumErr;    //!< Sum of the period errors
+    double sumErr2;   //!< Sum of the squared period errors
+};
+
+#endif /*REALTIME_H_*/
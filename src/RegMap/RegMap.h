@@ -0,0 +1,176 @@
+/*!
+  @file RegMap.h
+  @brief Compile-time description of chip registers and bit fields
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+  @details  Fields are declared once with position and width, registers
+            once with address, size and byte order on the bus. Encoding,
+            decoding and transaction buffers are constexpr: with constant
+            inputs they fold at compile time, otherwise they reduce to the
+            same shifts and masks written by hand.
+
+            A chip driver is a class template over a map made of these
+            types, so a chip variant with a different map (e.g. another
+            resolution) is just another instantiation.
+*/
+
+#ifndef REGMAP_H_
+#define REGMAP_H_
+
+#include <stdint.h>
+
+/*!
+  Byte order of a multi-byte register on the bus
+*/
+enum endianT : uint8_t {
+  msbFirst = 0,
+  lsbFirst = 1
+};
+
+/*!
+  @brief Bit field of a register
+  @tparam pos Position of the LSb
+  @tparam width Width in bits
+*/
+template <unsigned pos, unsigned width>
+struct regField {
+  static_assert(width > 0 && pos + width <= 16, "Field outside a 16-bit register");
+
+  static constexpr unsigned position = pos;  //!< Position of the LSb
+  static constexpr unsigned bits = width;    //!< Width in bits
+  static constexpr uint16_t max = static_cast<uint16_t>((1u << width) - 1); //!< Largest value
+  static constexpr uint16_t mask = static_cast<uint16_t>(max << pos);       //!< Mask in the register
+
+  /*!
+    Place a value in the field; out-of-range bits are dropped
+    @param[in] value Field value
+    @return Register bits
+  */
+  static constexpr uint16_t encode(uint16_t value) {
+    return static_cast<uint16_t>((value & max) << pos);
+  }
+
+  /*!
+    Extract the field
+    @param[in] reg Register content
+    @return Field value
+  */
+  static constexpr uint16_t decode(uint16_t reg) {
+    return static_cast<uint16_t>((reg >> pos) & max);
+  }
+};
+
+/*!
+  @brief Set of non-overlapping fields of a register, packed together
+  @tparam fieldsT regField types, in the order of pack() arguments
+*/
+template <typename... fieldsT>
+struct regFields;
+
+//! @cond
+template <>
+struct regFields<> {
+  static constexpr uint16_t mask = 0;
+  static constexpr uint16_t pack() { return 0; }
+};
+
+template <typename fieldT, typename... restT>
+struct regFields<fieldT, restT...> {
+  static_assert((fieldT::mask & regFields<restT...>::mask) == 0, "Overlapping fields");
+  static constexpr uint16_t mask = fieldT::mask | regFields<restT...>::mask;
+
+  template <typename... valuesT>
+  static constexpr uint16_t pack(uint16_t value, valuesT... rest) {
+    return fieldT::encode(value) | regFields<restT...>::pack(rest...);
+  }
+};
+//! @endcond
+
+/*!
+  @brief Bytes of a transaction
+  @tparam n Number of bytes
+*/
+template <unsigned n>
+struct txFrameT {
+  uint8_t data[n]; //!< Bytes, in bus order
+};
+
+//! @cond
+template <unsigned bytes, endianT endian>
+struct regBytes;
+
+template <endianT endian>
+struct regBytes<1, endian> {
+  static constexpr txFrameT<2> frame(uint8_t first, uint16_t value) {
+    return {{first, static_cast<uint8_t>(value & 0xFF)}};
+  }
+  static constexpr uint16_t join(const uint8_t* buf) {
+    return buf[0];
+  }
+};
+
+template <>
+struct regBytes<2, msbFirst> {
+  static constexpr txFrameT<3> frame(uint8_t first, uint16_t value) {
+    return {{first, static_cast<uint8_t>((value >> 8) & 0xFF), static_cast<uint8_t>(value & 0xFF)}};
+  }
+  static constexpr uint16_t join(const uint8_t* buf) {
+    return static_cast<uint16_t>(((buf[0] << 8) & 0xFF00) | (buf[1] & 0x00FF));
+  }
+};
+
+template <>
+struct regBytes<2, lsbFirst> {
+  static constexpr txFrameT<3> frame(uint8_t first, uint16_t value) {
+    return {{first, static_cast<uint8_t>(value & 0xFF), static_cast<uint8_t>((value >> 8) & 0xFF)}};
+  }
+  static constexpr uint16_t join(const uint8_t* buf) {
+    return static_cast<uint16_t>(((buf[1] << 8) & 0xFF00) | (buf[0] & 0x00FF));
+  }
+};
+//! @endcond
+
+/*!
+  @brief Register of a chip
+  @tparam addr Register address (pointer byte)
+  @tparam bytes Register size: 1 or 2 bytes
+  @tparam endian Byte order on the bus of a 2-byte register
+*/
+template <uint8_t addr, unsigned bytes, endianT endian>
+struct regDesc {
+  static_assert(bytes == 1 || bytes == 2, "Only 8- and 16-bit registers");
+
+  static constexpr uint8_t address = addr;       //!< Register address
+  static constexpr unsigned size = bytes;        //!< Register size in bytes
+  static constexpr unsigned frameSize = 1 + bytes; //!< Pointer/command byte plus data
+  typedef txFrameT<1 + bytes> frameT;            //!< Write transaction
+
+  /*!
+    Write transaction addressed by the register pointer
+    @param[in] value Register content
+    @return Transaction bytes
+  */
+  static constexpr frameT write(uint16_t value) {
+    return regBytes<bytes, endian>::frame(addr, value);
+  }
+
+  /*!
+    Write transaction with an explicit first byte (e.g. a command byte)
+    @param[in] first First byte of the transaction
+    @param[in] value Register content
+    @return Transaction bytes
+  */
+  static constexpr frameT write(uint8_t first, uint16_t value) {
+    return regBytes<bytes, endian>::frame(first, value);
+  }
+
+  /*!
+    Register content from the bytes read from the bus
+    @param[in] buf size bytes, in bus order
+    @return Register content
+  */
+  static constexpr uint16_t read(const uint8_t* buf) {
+    return regBytes<bytes, endian>::join(buf);
+  }
+};
+
+#endif /*REGMAP_H_*/
@@ -15,21 +15,34 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <atomic>
+#include <thread>
 //#include "hwlib.h"
 
 #include "../NewHV/NewHV.h"
+#include "../BusScheduler/BusScheduler.h"
+#include "../IVSweep/IVSweep.h"
+#include "../I2CPolicy/I2CPolicy.h"
+#include "../RealTime/RealTime.h"
 
 NewHVIntf* nhv = nullptr; //!< Pointer to the NewHVIntf instance
+int busFile = -1; //!< I2C bus of nhv
+ivSweep* sweep = nullptr; //!< Sweep in progress, if any
+volatile sig_atomic_t stopRequested = 0; //!< Set by SIGINT
 
 /*!
-  Cleanly close the interface to the board.
-  @param signum
+  Cleanly close the interface to the board and exit; called from main once
+  no other thread uses the board.
+  @param signum Exit code
 */
 void closeIntf(int signum){
   printf("\nKilling NewHV interface...");
   
   if(nhv!=nullptr){
+    //The destructor may ramp the bias down
+    busScheduler::lockBus(busFile);
     delete nhv;
+    busScheduler::unlockBus(busFile);
   }
 
   printf(" done\n");
@@ -37,22 +50,202 @@ void closeIntf(int signum){
 }
 
 
+/*!
+  Run a bus operation with the policy, holding the cross-process bus lock
+  only for that transaction, so that the safety jobs of other processes
+  wait at most for it
+  @param i2cHandle I2C bus
+  @param policy Retry and recovery policy of the bus
+  @param op Bus operation
+  @return Outcome
+*/
+template <typename opT>
+i2cPolicy::errT lockedRun(int i2cHandle, i2cPolicy& policy, opT op) {
+  if (!busScheduler::lockBus(i2cHandle)) {
+    return i2cPolicy::failed;
+  }
+  i2cPolicy::errT err = policy.run(op);
+  busScheduler::unlockBus(i2cHandle);
+  return err;
+}
+
+
+/*!
+  SIGINT handler: stop the auto-read loop at the end of the current period
+  and the sweep after the current point; main then closes the interface.
+  @param signum
+*/
+void requestStop(int signum){
+  (void)signum;
+  stopRequested = 1;
+  if (sweep != nullptr) {
+    sweep->abort();
+  }
+}
+
+
+/*!
+  Read the current monitor every period until SIGINT, then report the
+  measured sampling jitter. The readings are taken by a thread in the
+  real-time configuration, that neither allocates nor writes to the
+  console; the calling thread prints the last reading about every second.
+  @param i2cHandle I2C bus
+  @param policy Retry and recovery policy of the bus
+  @param periodUs Auto-read interval, in us
+  @param rt Real-time configuration of the loop
+*/
+void monitorLoop(int i2cHandle, i2cPolicy& policy, uint32_t periodUs,
+                 const rtMode::cfgT& rt) {
+  if (rt.enable) {
+    rtMode::lockMemory();
+  }
+  jitterMeter jitter(periodUs);
+  std::atomic<float> lastCurrent(0.0);
+  std::atomic<bool> lastAlert(false);
+
+  std::thread reader([i2cHandle, &policy, periodUs, &rt, &jitter, &lastCurrent, &lastAlert] {
+    rtMode::apply(rt);
+    bool ok = false;
+    float current = 0.0;
+    bool alert = false;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (!stopRequested) {
+      i2cPolicy::errT err = lockedRun(i2cHandle, policy, [i2cHandle, &ok] {
+        return NewHVIntf::readAdcBatch(i2cHandle, &nhv, &ok, 1) == 1;
+      });
+      if (err == i2cPolicy::ok) {
+        nhv->readAdc(current, alert);
+        lastCurrent.store(current, std::memory_order_relaxed);
+        lastAlert.store(alert, std::memory_order_relaxed);
+      }
+
+      //Absolute deadlines, so that the period does not drift
+      rtMode::addUs(next, periodUs);
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+      jitter.sample(next);
+    }
+  });
+
+  uint32_t printUs = (periodUs < 1000000) ? 1000000 : periodUs;
+  while (!stopRequested) {
+    printf("I = %.3f uA%s\n", lastCurrent.load(std::memory_order_relaxed),
+           lastAlert.load(std::memory_order_relaxed) ? " (alert)" : "");
+    usleep(printUs);
+  }
+  reader.join();
+
+  jitter.print("Auto-read");
+}
+
+
+/*!
+  Run an IV sweep on one board, without HV cycles between the points.
+  @param argc
+  @param argv
+  @return Exit code
+*/
+int sweepMain(int argc, char *argv[]) {
+  if (argc < 10) {
+    printf("Usage:\n\tEFORO(arm) sweep <Start> <Stop> <Step> <Settle> <Samples> <DAC address> <ADC address> <Output file>\n\n");
+    printf("\tStart, Stop, Step:\tFloat\tVoltage points in volts\n");
+    printf("\tSettle:\t\t\tuint32_t\tSettle time at each point in ms\n");
+    printf("\tSamples:\t\tuint32_t\tReadings averaged at each point\n");
+    printf("\tDAC address:\t\tuint8\tI2c address of DAC\n");
+    printf("\tADC address:\t\tuint8\tI2c address of ADC\n");
+    printf("\tOutput file:\t\tPath\tIV curve output\n");
+    return 0;
+  }
+  ivSweep::sweepCfgT cfg;
+  cfg.voltages   = ivSweep::ramp(std::stof(argv[2]), std::stof(argv[3]), std::stof(argv[4]));
+  cfg.settleUs   = uint32_t(atoi(argv[5])) * 1000;
+  cfg.nSamples   = uint32_t(atoi(argv[6]));
+  cfg.intervalUs = 0;
+  cfg.finalV     = 0.0;
+  int dacAddr    = uint8_t(atoi(argv[7]));
+  int adcAddr    = uint8_t(atoi(argv[8]));
+
+  //Open I2C bus; the DAC is the default slave, the ADC is addressed by the batched reads
+  int i2cHandle = 0;
+  const char *i2cDevice = "/dev/i2c-1";
+  if ((i2cHandle = open(i2cDevice, O_RDWR)) < 0) {
+    perror("Failed to open the i2c bus");
+    exit(1);
+  }
+  if (ioctl(i2cHandle, I2C_SLAVE, dacAddr) < 0) {
+    printf("Failed to acquire bus access and/or talk to slave.\n");
+    exit(1);
+  }
+  busFile = i2cHandle;
+
+  signal(SIGINT, requestStop);
+
+  printf("Starting IV sweep (%zu points)...\n", cfg.voltages.size());
+  //The constructor configures the ADC: hold the bus meanwhile
+  if (!busScheduler::lockBus(i2cHandle)) {
+    exit(1);
+  }
+  nhv = new NewHVIntf(i2cHandle, 0, dacAddr, adcAddr);
+  busScheduler::unlockBus(i2cHandle);
+  i2cPolicy policy(i2cDevice, i2cHandle, dacAddr);
+  NewHVAsync bus(i2cHandle);
+  bus.setPolicy(&policy);
+  std::vector<unsigned> channels(1, bus.addChannel(nhv));
+
+  ivSweep ivs;
+  ivs.addBus(&bus, channels);
+  sweep = &ivs;
+  bool bSuccess = !stopRequested && ivs.run(cfg, argv[9]);
+  sweep = nullptr;
+  //No job may still use the board when it is deleted
+  bus.stop();
+  printf("IV sweep %s\n", stopRequested ? "interrupted" : (bSuccess ? "done" : "failed"));
+
+  //Cleanly delete interface
+  closeIntf(bSuccess ? 0 : 1);
+
+  return 0;
+}
+
+
 int main(int argc, char *argv[]) {
   std::cout<<"hash="<<GIT_HASH<<", time="<<COMPILE_TIME<<", branch="<<GIT_BRANCH<<std::endl;
   
   //Args
+  if (argc > 1 && strcmp(argv[1], "sweep") == 0) {
+    return sweepMain(argc, argv);
+  }
   if (argc < 5) {
-    printf("Usage:\n\tEFORO(arm) <Voltage> <Auto-read intervals> <DAC address> <ADC address>\n\n");
+    printf("Usage:\n\tEFORO(arm) <Voltage> <Auto-read intervals> <DAC address> <ADC address> [State file] [RT CPU] [RT priority]\n");
+    printf("\tEFORO(arm) sweep ...\t(run with no further arguments for help)\n\n");
     printf("\tVoltage:\t\tFloat\tVoltage output in volts\n");
-    printf("\tAuto-read intervals:\tuint32_t\tIntervals in us; 0: off\n");
+    printf("\tAuto-read intervals:\tuint32_t\tIntervals in us; read until Ctrl-C; 0: off\n");
     printf("\tDAC address:\t\tuint8\tI2c address of DAC\n");
     printf("\tADC address:\t\tuint8\tI2c address of ADC\n");
+    printf("\tState file:\t\tPath\tWarm start from/keep HV up in this file; default or -: cold start, HV off at exit\n");
+    printf("\tRT CPU:\t\t\tint\tReal-time auto-read pinned to this CPU (-1: any); default: real-time off\n");
+    printf("\tRT priority:\t\tint\tSCHED_FIFO priority of the auto-read (1-99); default: 50\n");
     return 0;
   }
   float voltageIn   = std::stof(argv[1]);
   int autoReadIn  = uint32_t(atoi(argv[2]));
   int dacAddr     = uint8_t(atoi(argv[3]));
   int adcAddr     = uint8_t(atoi(argv[4]));
+  std::string stateFile = (argc > 5 && strcmp(argv[5], "-") != 0) ? argv[5] : "";
+  rtMode::cfgT rt = rtMode::defaultCfg();
+  if (argc > 6) {
+    rt.enable = true;
+    rt.cpu = atoi(argv[6]);
+    if (argc > 7) {
+      rt.priority = atoi(argv[7]);
+    }
+    if (rt.cpu < -1 || rt.priority < 1 || rt.priority > 99) {
+      printf("Invalid RT CPU (%d) or priority (%d): priority must be 1-99\n",
+             rt.cpu, rt.priority);
+      return 1;
+    }
+  }
 
   //Open I2C bus
   int i2cHandle = 0;
@@ -70,16 +263,38 @@ int main(int argc, char *argv[]) {
   	  exit(1);
 	}
 
-  signal(SIGINT, closeIntf);
+  //Exclusive access with respect to other processes on the same bus is
+  //taken for each transaction only (see lockedRun())
+  busFile = i2cHandle;
+  signal(SIGINT, requestStop);
 
   printf("Starting NewHV interface...\n");
-  nhv = new NewHVIntf(i2cHandle, autoReadIn, dacAddr, adcAddr);
+  //The constructor configures or reads back the ADC: hold the bus meanwhile
+  if (!busScheduler::lockBus(i2cHandle)) {
+    exit(1);
+  }
+  if (stateFile.empty()) {
+    nhv = new NewHVIntf(i2cHandle, autoReadIn, dacAddr, adcAddr);
+  } else {
+    nhv = new NewHVIntf(i2cHandle, autoReadIn, dacAddr, adcAddr,
+                        NewHVIntf::warm, stateFile);
+    nhv->setShutdownMode(NewHVIntf::keepHV);
+  }
+  busScheduler::unlockBus(i2cHandle);
   
   //Apply DAC bias
   nhv->setBias(voltageIn);
-  nhv->applyBias();
+  i2cPolicy policy(i2cDevice, i2cHandle, dacAddr);
+  policy.addReapply([] { return nhv->reapplyState(); });
+  i2cPolicy::errT err = lockedRun(i2cHandle, policy, [] { return nhv->applyBias(); });
+  if (err != i2cPolicy::ok) {
+    printf("Failed to apply bias (error %d)\n", err);
+  }
 
-  //FIXME: Always running ADC?
+  //Monitor the current
+  if (autoReadIn > 0 && !stopRequested) {
+    monitorLoop(i2cHandle, policy, autoReadIn, rt);
+  }
 
   //Cleanly delete interface
   closeIntf(0);
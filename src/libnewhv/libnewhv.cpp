@@ -0,0 +1,384 @@
+/*!
+  @file libnewhv.cpp
+  @brief C interface of libnewhv, the embeddable NewHV driver library
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#include "libnewhv.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <linux/i2c-dev.h>
+#include <sys/ioctl.h>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "../NewHV/NewHV.h"
+#include "../BusScheduler/BusScheduler.h"
+#include "../I2CPolicy/I2CPolicy.h"
+#include "../RealTime/RealTime.h"
+
+/*!
+  @brief Board handle behind nhv_board_t
+*/
+struct nhv_board {
+  int fd;                   //!< Own file on the I2C bus
+  NewHVIntf* nhv;           //!< Board interface
+  i2cPolicy* policy;        //!< Retry and recovery policy of fd
+  std::mutex mtx;           //!< Serialises the calls on the handle
+  std::mutex streamMtx;     //!< Serialises nhv_subscribe() and nhv_unsubscribe()
+
+  std::thread stream;       //!< Streaming thread
+  std::atomic<bool> streaming; //!< Streaming thread is running
+  uint32_t periodUs;        //!< Streaming period, in us
+  nhv_sample_t* buf;        //!< Caller's sample buffer
+  size_t bufLen;            //!< Samples in buf
+  nhv_sample_cb cb;         //!< Streaming callback
+  void* user;               //!< Streaming-callback argument
+  rtMode::cfgT rt;          //!< Real-time configuration of the streaming thread
+  jitterMeter jitter;       //!< Streaming jitter; protected by mtx
+};
+
+
+/*!
+  Run a bus operation of a board under the bus lock and the policy; the
+  handle mutex must be held
+  @param[in] board Board handle
+  @param[in] op Bus operation
+  @return Error code
+*/
+template <typename opT>
+static int busOp(nhv_board_t* board, opT op) {
+  if (!busScheduler::lockBus(board->fd)) {
+    return NHV_ERR_FAILED;
+  }
+  int err = board->policy->run(op);
+  busScheduler::unlockBus(board->fd);
+  return err;
+}
+
+
+/*!
+  Read the current monitor of a board; the handle mutex must be held
+  @param[in] board Board handle
+  @param[out] sample Sample
+  @return Error code
+*/
+static int readSample(nhv_board_t* board, nhv_sample_t* sample) {
+  bool ok = false;
+  NewHVIntf* nhv = board->nhv;
+  int fd = board->fd;
+  int err = busOp(board, [nhv, fd, &ok] {
+    return NewHVIntf::readAdcBatch(fd, &nhv, &ok, 1) == 1;
+  });
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  int64_t realNs = static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+  memset(sample, 0, sizeof(*sample));
+  sample->t_ns = realNs;
+  if (err == NHV_OK) {
+    bool alert;
+    nhv->readAdc(sample->current_ua, alert);
+    sample->alert = alert;
+
+    //Conversion time, moved from the monotonic to the real-time clock
+    convTiming::resultT timing = nhv->getTiming();
+    sample->t_ns = realNs + (timing.tNs - convTiming::monotonicNs());
+    sample->flags = (timing.duplicate ? NHV_SAMPLE_DUPLICATE : 0)
+                    | ((timing.skipped > 0) ? NHV_SAMPLE_SKIPPED : 0)
+                    | (timing.locked ? 0 : NHV_SAMPLE_UNLOCKED);
+  } else {
+    //Streamed samples carry no error code: tell them from a 0 uA reading
+    sample->flags = NHV_SAMPLE_ERROR;
+  }
+  return err;
+}
+
+
+/*!
+  Streaming-thread loop
+  @param[in] board Board handle
+*/
+static void streamLoop(nhv_board_t* board) {
+  //Nothing is allocated from here on
+  rtMode::apply(board->rt);
+  if (board->rt.enable) {
+    rtMode::prefault(board->buf, board->bufLen * sizeof(nhv_sample_t));
+  }
+
+  size_t n = 0;
+  bool first = true;
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (board->streaming.load(std::memory_order_acquire)) {
+    //Wake-up time taken before waiting for the handle
+    struct timespec wake;
+    clock_gettime(CLOCK_MONOTONIC, &wake);
+    {
+      std::lock_guard<std::mutex> lock(board->mtx);
+      if (!first) {
+        board->jitter.sample(next, wake);
+      }
+      readSample(board, &board->buf[n]);
+    }
+    first = false;
+    if (++n == board->bufLen) {
+      board->cb(board->user, board->buf, n);
+      n = 0;
+    }
+
+    //Absolute deadlines, so that the period does not drift
+    rtMode::addUs(next, board->periodUs);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+  }
+
+  if (n > 0) {
+    board->cb(board->user, board->buf, n);
+  }
+}
+
+
+uint32_t nhv_abi_version(void) {
+  return NHV_ABI_VERSION;
+}
+
+
+int nhv_open(const char* device, uint8_t dac_addr, uint8_t adc_addr,
+             int start_mode, const char* state_file, nhv_board_t** out) {
+  if (device == nullptr || out == nullptr) {
+    return NHV_ERR_ARG;
+  }
+
+  int fd = open(device, O_RDWR);
+  if (fd < 0) {
+    return NHV_ERR_OPEN;
+  }
+  //The DAC is the default slave; the ADC is addressed by the batched reads
+  if (ioctl(fd, I2C_SLAVE, dac_addr) < 0) {
+    close(fd);
+    return NHV_ERR_OPEN;
+  }
+
+  //The constructor configures or reads back the ADC: hold the bus meanwhile
+  if (!busScheduler::lockBus(fd)) {
+    close(fd);
+    return NHV_ERR_OPEN;
+  }
+
+  //Nothing may throw through the C interface
+  nhv_board_t* board = nullptr;
+  try {
+    board = new nhv_board_t;
+    board->fd = fd;
+    board->nhv = nullptr;
+    board->policy = nullptr;
+    board->policy = new i2cPolicy(device, fd, dac_addr);
+    board->streaming = false;
+    board->periodUs = 0;
+    board->buf = nullptr;
+    board->bufLen = 0;
+    board->cb = nullptr;
+    board->user = nullptr;
+    board->rt = rtMode::defaultCfg();
+
+    board->nhv = new NewHVIntf(fd, 0, dac_addr, adc_addr,
+                               (start_mode == NHV_START_WARM) ? NewHVIntf::warm : NewHVIntf::cold,
+                               (state_file != nullptr) ? state_file : "");
+    //nhv_set_bias() must not allocate: the state file is written at close
+    board->nhv->setSaveOnApply(false);
+
+    NewHVIntf* nhv = board->nhv;
+    board->policy->addReapply([nhv] { return nhv->reapplyState(); });
+  } catch (const std::exception&) {
+    if (board != nullptr) {
+      //The bias was not touched: leave it as it is
+      if (board->nhv != nullptr) {
+        board->nhv->setShutdownMode(NewHVIntf::keepHV);
+        delete board->nhv;
+      }
+      delete board->policy;
+      delete board;
+    }
+    busScheduler::unlockBus(fd);
+    close(fd);
+    return NHV_ERR_OPEN;
+  }
+  busScheduler::unlockBus(fd);
+
+  *out = board;
+  return NHV_OK;
+}
+
+
+int nhv_close(nhv_board_t* board, int shutdown_mode) {
+  if (board == nullptr) {
+    return NHV_ERR_ARG;
+  }
+  //The streaming thread cannot delete its own board
+  if (board->stream.get_id() == std::this_thread::get_id()) {
+    return NHV_ERR_BUSY;
+  }
+  nhv_unsubscribe(board);
+
+  {
+    std::lock_guard<std::mutex> lock(board->mtx);
+    board->nhv->setShutdownMode((shutdown_mode == NHV_KEEP_HV) ? NewHVIntf::keepHV
+                                                               : NewHVIntf::rampDown);
+    //The destructor may ramp the bias down
+    busScheduler::lockBus(board->fd);
+    delete board->nhv;
+    busScheduler::unlockBus(board->fd);
+    delete board->policy;
+    close(board->fd);
+  }
+
+  delete board;
+  return NHV_OK;
+}
+
+
+int nhv_set_bias(nhv_board_t* board, float volts) {
+  if (board == nullptr) {
+    return NHV_ERR_ARG;
+  }
+  std::lock_guard<std::mutex> lock(board->mtx);
+  NewHVIntf* nhv = board->nhv;
+  nhv->setBias(volts);
+  return busOp(board, [nhv] { return nhv->applyBias(); });
+}
+
+
+int nhv_get_bias(nhv_board_t* board, float* volts) {
+  if (board == nullptr || volts == nullptr) {
+    return NHV_ERR_ARG;
+  }
+  std::lock_guard<std::mutex> lock(board->mtx);
+  *volts = board->nhv->getBias();
+  return NHV_OK;
+}
+
+
+int nhv_read_current(nhv_board_t* board, nhv_sample_t* sample) {
+  if (board == nullptr || sample == nullptr) {
+    return NHV_ERR_ARG;
+  }
+  std::lock_guard<std::mutex> lock(board->mtx);
+  return readSample(board, sample);
+}
+
+
+int nhv_set_auto_conversion(nhv_board_t* board, int cycle_time) {
+  if (board == nullptr || cycle_time < adc101::cycleTimeT::off
+      || cycle_time > adc101::cycleTimeT::kspsP4) {
+    return NHV_ERR_ARG;
+  }
+  std::lock_guard<std::mutex> lock(board->mtx);
+  NewHVIntf* nhv = board->nhv;
+  adc101::cycleTimeT timer = static_cast<adc101::cycleTimeT>(cycle_time);
+  return busOp(board, [nhv, timer] { return nhv->setAutoConv(timer); });
+}
+
+
+int nhv_subscribe(nhv_board_t* board, uint32_t period_us,
+                  nhv_sample_t* buf, size_t buf_len,
+                  nhv_sample_cb cb, void* user) {
+  if (board == nullptr || period_us == 0 || buf == nullptr || buf_len == 0
+      || cb == nullptr) {
+    return NHV_ERR_ARG;
+  }
+  std::lock_guard<std::mutex> lock(board->streamMtx);
+  if (board->streaming.load()) {
+    return NHV_ERR_BUSY;
+  }
+  //Thread stopped from its own callback, not joined yet
+  if (board->stream.joinable()) {
+    if (board->stream.get_id() == std::this_thread::get_id()) {
+      return NHV_ERR_BUSY;
+    }
+    board->stream.join();
+  }
+  board->periodUs = period_us;
+  board->buf = buf;
+  board->bufLen = buf_len;
+  board->cb = cb;
+  board->user = user;
+  {
+    std::lock_guard<std::mutex> jitterLock(board->mtx);
+    board->jitter.reset(period_us);
+  }
+  board->streaming = true;
+  try {
+    board->stream = std::thread(streamLoop, board);
+  } catch (const std::exception&) {
+    //Out of threads or memory: nothing may throw through the C interface
+    board->streaming = false;
+    return NHV_ERR_FAILED;
+  }
+  return NHV_OK;
+}
+
+
+int nhv_unsubscribe(nhv_board_t* board) {
+  if (board == nullptr) {
+    return NHV_ERR_ARG;
+  }
+  //From the callback: the thread ends after it returns and is joined by
+  //the next nhv_subscribe(), nhv_unsubscribe() or nhv_close(). streamMtx
+  //is not taken: another thread may hold it while joining this one
+  if (board->stream.get_id() == std::this_thread::get_id()) {
+    board->streaming = false;
+    return NHV_OK;
+  }
+  std::lock_guard<std::mutex> lock(board->streamMtx);
+  board->streaming = false;
+  if (board->stream.joinable()) {
+    board->stream.join();
+  }
+  return NHV_OK;
+}
+
+
+int nhv_set_realtime(nhv_board_t* board, int cpu, int priority) {
+  if (board == nullptr || priority < 0 || priority > 99 || cpu < -1) {
+    return NHV_ERR_ARG;
+  }
+  std::lock_guard<std::mutex> lock(board->streamMtx);
+  if (board->streaming.load()) {
+    return NHV_ERR_BUSY;
+  }
+  board->rt.enable = (priority > 0);
+  board->rt.cpu = cpu;
+  board->rt.priority = priority;
+  return NHV_OK;
+}
+
+
+int nhv_lock_memory(void) {
+  return rtMode::lockMemory() ? NHV_OK : NHV_ERR_FAILED;
+}
+
+
+int nhv_get_jitter(nhv_board_t* board, nhv_jitter_t* jitter) {
+  if (board == nullptr || jitter == nullptr) {
+    return NHV_ERR_ARG;
+  }
+  jitterMeter::statsT st;
+  {
+    std::lock_guard<std::mutex> lock(board->mtx);
+    st = board->jitter.getStats();
+  }
+  jitter->periods = st.periods;
+  jitter->min_err_ns = st.minErrNs;
+  jitter->max_err_ns = st.maxErrNs;
+  jitter->mean_err_ns = st.meanErrNs;
+  jitter->rms_err_ns = st.rmsErrNs;
+  jitter->max_latency_ns = st.maxLatNs;
+  jitter->overruns = st.overruns;
+  return NHV_OK;
+}
@@ -0,0 +1,213 @@
+/*!
+  @file libnewhv.h
+  @brief C interface of libnewhv, the embeddable NewHV driver library
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+  @details  Stable C ABI to drive NewHV boards in-process, without running
+            EFORO. Every board handle owns its own file on the I2C bus and
+            takes the cross-process bus lock (see busScheduler::lockBus())
+            for each transaction, so handles of the same or of different
+            processes can share the bus.
+
+            Calls are thread-safe per handle. Apart from nhv_open() and
+            nhv_subscribe(), they use caller-provided buffers and do not
+            allocate.
+
+            All the functions return NHV_OK or a negative error code.
+*/
+
+#ifndef LIBNEWHV_H_
+#define LIBNEWHV_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define NHV_API __attribute__((visibility("default")))
+#else
+#define NHV_API
+#endif
+
+#define NHV_ABI_VERSION 1 /*!< Incremented at every incompatible change */
+
+/* Error codes; -1 to -3 match i2cPolicy::errT */
+#define NHV_OK             0   /*!< Success */
+#define NHV_ERR_FAILED    -1   /*!< Bus operation failed after all the retries */
+#define NHV_ERR_BUS_STUCK -2   /*!< Bus recovered, but the operation still fails */
+#define NHV_ERR_RECOVERY  -3   /*!< Bus stuck and re-opening it failed */
+#define NHV_ERR_ARG       -10  /*!< Invalid argument */
+#define NHV_ERR_OPEN      -11  /*!< Cannot open the I2C device or address the board */
+#define NHV_ERR_BUSY      -12  /*!< A subscription is already active */
+
+/* Startup and shutdown modes, see NewHVIntf::startModeT and NewHVIntf::shutdownModeT */
+#define NHV_START_COLD    0    /*!< Blank device */
+#define NHV_START_WARM    1    /*!< Adopt the device state */
+#define NHV_RAMP_DOWN     0    /*!< Drive the bias to 0 V at close */
+#define NHV_KEEP_HV       1    /*!< Leave the bias up at close */
+
+/* Sample flags, see nhv_sample_t and nhv_set_auto_conversion() */
+#define NHV_SAMPLE_DUPLICATE 0x1 /*!< Same ADC conversion as the previous sample */
+#define NHV_SAMPLE_SKIPPED   0x2 /*!< ADC conversions missed since the previous sample */
+#define NHV_SAMPLE_UNLOCKED  0x4 /*!< Conversion timing not locked yet: t_ns is the read time */
+#define NHV_SAMPLE_ERROR     0x8 /*!< The reading failed: current_ua and alert are not valid */
+
+/*!
+  Opaque board handle
+*/
+typedef struct nhv_board nhv_board_t;
+
+/*!
+  Current-monitor sample
+*/
+typedef struct nhv_sample {
+  uint64_t t_ns;       /*!< CLOCK_REALTIME sample time, in ns; drift-corrected
+                            conversion time in automatic conversion */
+  float current_ua;    /*!< Current monitor, in uA */
+  uint8_t alert;       /*!< ADC alert flag */
+  uint8_t reserved[3]; /*!< Reserved, set to 0 */
+  uint32_t flags;      /*!< Sample flags (NHV_SAMPLE_*); 0 if none */
+} nhv_sample_t;
+
+/*!
+  Wake-up jitter of the streaming thread, see nhv_get_jitter(); times in ns
+*/
+typedef struct nhv_jitter {
+  uint64_t periods;       /*!< Measured periods */
+  int64_t min_err_ns;     /*!< Smallest period error (measured - nominal) */
+  int64_t max_err_ns;     /*!< Largest period error */
+  int64_t mean_err_ns;    /*!< Mean period error */
+  int64_t rms_err_ns;     /*!< RMS period error */
+  int64_t max_latency_ns; /*!< Largest delay of a read after its deadline */
+  uint64_t overruns;      /*!< Reads later than one whole period */
+} nhv_jitter_t;
+
+/*!
+  Streaming callback; the samples are valid only until it returns
+  @param[in] user User pointer given to nhv_subscribe()
+  @param[in] samples Samples, in the buffer given to nhv_subscribe()
+  @param[in] n Number of samples
+*/
+typedef void (*nhv_sample_cb)(void* user, const nhv_sample_t* samples, size_t n);
+
+/*!
+  ABI version of the library
+  @return NHV_ABI_VERSION the library was built with
+*/
+NHV_API uint32_t nhv_abi_version(void);
+
+/*!
+  Open a board. With a state file, the applied DAC code is written to it
+  by nhv_close() only, so that nhv_set_bias() does not touch the filesystem
+  @param[in] device I2C device path, e.g. "/dev/i2c-1"
+  @param[in] dac_addr I2C address of the DAC
+  @param[in] adc_addr I2C address of the ADC
+  @param[in] start_mode NHV_START_COLD or NHV_START_WARM
+  @param[in] state_file File persisting the DAC code; NULL: none
+  @param[out] out Board handle
+  @return Error code
+*/
+NHV_API int nhv_open(const char* device, uint8_t dac_addr, uint8_t adc_addr,
+                     int start_mode, const char* state_file, nhv_board_t** out);
+
+/*!
+  Close a board; stops the subscription, if any, and writes the state file
+  @param[in] board Board handle; invalid after the call
+  @param[in] shutdown_mode NHV_RAMP_DOWN or NHV_KEEP_HV
+  @return Error code; NHV_ERR_BUSY from the streaming callback
+*/
+NHV_API int nhv_close(nhv_board_t* board, int shutdown_mode);
+
+/*!
+  Set and apply the bias
+  @param[in] board Board handle
+  @param[in] volts Bias, in volts
+  @return Error code
+*/
+NHV_API int nhv_set_bias(nhv_board_t* board, float volts);
+
+/*!
+  Get the bias set
+  @param[in] board Board handle
+  @param[out] volts Bias, in volts
+  @return Error code
+*/
+NHV_API int nhv_get_bias(nhv_board_t* board, float* volts);
+
+/*!
+  Read the current monitor
+  @param[in] board Board handle
+  @param[out] sample Sample
+  @return Error code
+*/
+NHV_API int nhv_read_current(nhv_board_t* board, nhv_sample_t* sample);
+
+/*!
+  Let the ADC convert on its own clock at a fixed rate. The samples then
+  carry the conversion time estimated from the readings and are flagged
+  when they repeat or miss conversions; read at least twice per conversion
+  to lock the timing (see convTiming).
+  @param[in] board Board handle
+  @param[in] cycle_time 0: off (a conversion per reading); 1 (27 ksps) to
+             7 (0.4 ksps), halving the rate at every step
+  @return Error code
+*/
+NHV_API int nhv_set_auto_conversion(nhv_board_t* board, int cycle_time);
+
+/*!
+  Stream the current monitor: a library thread reads the board every
+  period_us and calls cb every time buf is full
+  @param[in] board Board handle
+  @param[in] period_us Sampling period, in us
+  @param[in] buf Sample buffer, owned by the caller until nhv_unsubscribe()
+  @param[in] buf_len Samples in buf (at least 1)
+  @param[in] cb Callback
+  @param[in] user Passed to cb
+  @return Error code
+*/
+NHV_API int nhv_subscribe(nhv_board_t* board, uint32_t period_us,
+                          nhv_sample_t* buf, size_t buf_len,
+                          nhv_sample_cb cb, void* user);
+
+/*!
+  Stop streaming; the samples still in the buffer are delivered first.
+  From the streaming callback it only stops the thread, that ends after
+  the callback returns (no further callbacks are made)
+  @param[in] board Board handle
+  @return Error code
+*/
+NHV_API int nhv_unsubscribe(nhv_board_t* board);
+
+/*!
+  Run the streaming thread of a board in real-time mode (see rtMode):
+  pinned to a CPU, with SCHED_FIFO priority and pre-faulted stack and
+  sample buffer. Takes effect at the next nhv_subscribe().
+  @param[in] board Board handle
+  @param[in] cpu CPU to pin the thread to; -1: any
+  @param[in] priority SCHED_FIFO priority, 1 to 99; 0: real-time mode off
+  @return Error code; NHV_ERR_BUSY while streaming
+*/
+NHV_API int nhv_set_realtime(nhv_board_t* board, int cpu, int priority);
+
+/*!
+  Lock the current and future memory of the calling process, so that the
+  real-time threads never page-fault (process-wide; call it at startup)
+  @return Error code
+*/
+NHV_API int nhv_lock_memory(void);
+
+/*!
+  Wake-up jitter of the streaming thread since the last nhv_subscribe()
+  @param[in] board Board handle
+  @param[out] jitter Statistics
+  @return Error code
+*/
+NHV_API int nhv_get_jitter(nhv_board_t* board, nhv_jitter_t* jitter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*LIBNEWHV_H_*/
@@ -0,0 +1,121 @@
+/*!
+  @file testConvTiming.cpp
+  @brief Replay of simulated ADC readings through convTiming
+  @author Mattia Barbanera (mattia.barbanera@infn.it)
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <random>
+
+#include "ConvTiming/ConvTiming.h"
+
+//! Readings of a replay
+static const int nReads = 20000;
+//! Readings before the checks start
+static const int settleReads = 2000;
+//! Nominal conversion period: 3.375 ksps
+static const uint32_t nominalNs = 296296;
+
+
+/*!
+  Replay readings of an ADC converting with a period off the nominal one
+  @param[in] lo Shortest interval between readings, in periods
+  @param[in] hi Longest interval between readings, in periods
+  @param[in] fac True period over the nominal one
+  @param[in] change Chance that a conversion changes the code, within 1 LSB
+             of 500 (low noise); < 0: random codes
+  @param[in] maxWrong Largest share of locked readings counted wrong
+  @param[in] maxUnlocked Largest share of readings left unlocked
+  @param[in] seed Seed of the readings
+  @return Number of failed checks
+*/
+static int replay(double lo, double hi, double fac, double change,
+                  double maxWrong, double maxUnlocked, unsigned seed) {
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+  double periodNs = nominalNs * fac;
+  double phaseNs = periodNs * unif(gen);
+
+  convTiming timing(nominalNs);
+  double tNs = 1e9;
+  int64_t prevConv = -1;
+  uint16_t word = 500;
+  int firstLock = -1;
+  int nChecked = 0;
+  int nUnlocked = 0;
+  int wrongDup = 0;
+  int wrongSkip = 0;
+  int dupChanged = 0;
+
+  for (int ii = 0; ii < nReads; ii++) {
+    tNs += periodNs * (lo + (hi - lo) * unif(gen));
+    int64_t conv = static_cast<int64_t>(floor((tNs - phaseNs) / periodNs));
+    uint16_t prevWord = word;
+    for (int64_t cc = prevConv + 1; cc <= conv; cc++) {
+      if (change < 0) {
+        word = static_cast<uint16_t>(unif(gen) * 1024);
+      } else if (unif(gen) < change) {
+        uint16_t next = word;
+        while (next == word) {
+          next = static_cast<uint16_t>(499 + unif(gen) * 3);
+        }
+        word = next;
+      }
+    }
+    convTiming::resultT res = timing.update(static_cast<int64_t>(tNs), word);
+
+    if (res.locked && firstLock < 0) {
+      firstLock = ii;
+    }
+    if (ii > 0 && res.duplicate && word != prevWord) {
+      dupChanged++;
+    }
+    if (ii >= settleReads) {
+      if (!res.locked) {
+        nUnlocked++;
+      } else {
+        nChecked++;
+        uint32_t skipped = (conv > prevConv + 1) ? conv - prevConv - 1 : 0;
+        if (res.duplicate != (conv == prevConv)) {
+          wrongDup++;
+        }
+        if (res.skipped != skipped) {
+          wrongSkip++;
+        }
+      }
+    }
+    prevConv = conv;
+  }
+
+  //Lock within 200 readings, keep it, and flag few readings wrong
+  int nFail = 0;
+  nFail += (firstLock < 0 || firstLock > 200);
+  nFail += (nUnlocked > maxUnlocked * (nReads - settleReads));
+  nFail += (wrongDup + wrongSkip > maxWrong * nChecked);
+  nFail += (dupChanged != 0);
+  nFail += (fabs(timing.getPeriodNs() / periodNs - 1) > 0.01);
+  printf("%s reads %.1f-%.1f P, period x%.2f, code change %.1f: lock at %d, "
+         "%d unlocked, %d wrong duplicates and %d wrong skips in %d, "
+         "%d changed duplicates, period %.0f/%.0f ns\n",
+         nFail ? "FAIL" : "ok  ", lo, hi, fac, change, firstLock, nUnlocked, wrongDup, wrongSkip, nChecked, dupChanged,
+         timing.getPeriodNs(), periodNs);
+  return nFail;
+}
+
+
+int main() {
+  int nFail = 0;
+  //Random codes
+  nFail += replay(0.8, 1.0, 1.07, -1, 0.002, 0.01, 1);
+  nFail += replay(0.8, 1.0, 0.93, -1, 0.002, 0.01, 2);
+  nFail += replay(0.5, 0.7, 1.07, -1, 0.002, 0.01, 3);
+  nFail += replay(0.3, 0.5, 0.93, -1, 0.002, 0.01, 4);
+  //Low noise: equal codes hide conversions
+  nFail += replay(0.8, 1.0, 1.07, 0.9, 0.03, 0.05, 5);
+  nFail += replay(0.5, 0.7, 0.93, 0.9, 0.03, 0.01, 6);
+  nFail += replay(0.5, 0.7, 1.07, 0.6, 0.03, 0.01, 7);
+  nFail += replay(0.5, 0.7, 0.93, 0.3, 0.03, 0.01, 8);
+  nFail += replay(0.3, 0.5, 1.07, 0.3, 0.03, 0.01, 9);
+  return nFail ? 1 : 0;
+}